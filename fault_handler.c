@@ -16,36 +16,335 @@
  */
 
 #include "fault_config.h"
+#include "fault_handler.h"
 
+#include <stddef.h>
 #include <stdint.h>
 
+#define FAULT_STR_(X)   #X
+#define FAULT_STR(X)    FAULT_STR_(X)
+
+/* Capture plan checks, see FAULT_PLAN_* in fault_handler.h. */
+#ifdef FAULT_RECORD_SLOT_SIZE
+_Static_assert(FAULT_PLAN_RECORD_BYTES <= FAULT_RECORD_SLOT_SIZE,
+               "Worst-case fault record does not fit FAULT_RECORD_SLOT_SIZE.");
+#endif
+#ifdef FAULT_RECORD_SECTION_SIZE
+_Static_assert(FAULT_PLAN_SECTION_BYTES <= FAULT_RECORD_SECTION_SIZE,
+               "Fault record, snapshots and counters do not fit FAULT_RECORD_SECTION_SIZE.");
+#endif
+#ifdef FAULT_CAPTURE_CYCLE_BUDGET
+_Static_assert(FAULT_PLAN_CAPTURE_CYCLES <= FAULT_CAPTURE_CYCLE_BUDGET,
+               "Estimated capture time exceeds FAULT_CAPTURE_CYCLE_BUDGET.");
+#endif
+#ifdef FAULT_RECORD_TLV
+_Static_assert(FAULT_PLAN_TLV_BYTES <= 0xffffu, "TLV section lengths are 16-bit.");
+_Static_assert(FAULT_PLAN_TLV_SECTIONS == FAULT_TLV_LAST, "FAULT_PLAN_TLV_BYTES does not count every TLV section type.");
+#endif
+#if defined(FAULT_SINK_WRITEV) && !defined(FAULT_RECORD_TLV)
+_Static_assert(sizeof(fault_record_t) <= 0xffffu, "fault_stream_header_t record_size is 16-bit.");
+#ifdef FAULT_STACK_WINDOW_WORDS
+_Static_assert(FAULT_STACK_WINDOW_WORDS * 4u <= 0xffffu, "fault_stream_header_t stack_size is 16-bit.");
+#endif
+#endif
+#ifdef FAULT_BACKUP_WORDS
+_Static_assert(FAULT_BACKUP_WORDS >= 5u, "Crash summary needs at least 5 backup registers.");
+#endif
+
+/* ARMv6-M (Cortex-M0/M0+): Thumb-1 only, no IT blocks, PUSH and POP take only R0-R7 with LR or PC. */
+#if defined(__ARM_ARCH_6M__)
+#define ARMV6M
+#endif
+
 /**
- * @brief Macro that should be called to report stack frame
- * and processor status register 
+ * @brief Exception entry instructions that load R0 with the address of the
+ * stack frame: MSP or PSP, depending on EXC_RETURN in LR. Uses R1 on ARMv6-M.
  */
-#define REPORT_STACK_FRAME	 __asm volatile \
-                ( \
+#ifdef ARMV6M
+#define SELECT_STACK_FRAME \
+                    "MOVS   R0, #0b0100;      " \
+                    "MOV    R1, LR;           " \
+                    "TST    R0, R1;           " \
+                    "MRS    R0, MSP;          " \
+                    "BEQ    1f;               " \
+                    "MRS    R0, PSP;          " \
+                    "1:                       "
+#else
+#define SELECT_STACK_FRAME \
   	                "TST    LR, #0b0100;      " \
   	                "ITE    EQ;               " \
  	                "MRSEQ  R0, MSP;          " \
-                    "MRSNE  R0, PSP;          " \
+                    "MRSNE  R0, PSP;          "
+#endif
+
+/**
+ * @brief Body of a naked fault handler. Calls fault_dispatch() with the stack frame,
+ * EXC_RETURN, fault class and R4-R11 saved on the handler stack, and returns
+ * from the exception if fault_dispatch() returns.
+ * @param CLASS: fault class, one of FAULT_CLASS_*.
+ */
+#ifdef ARMV6M
+/* Same stack layout as below, R8-R11 and LR go through low registers. */
+#define FAULT_ENTRY(CLASS)	 __asm volatile \
+                ( \
+                    SELECT_STACK_FRAME \
+                    "MOV    R1, R10;          " \
+                    "MOV    R2, R11;          " \
+                    "MOV    R3, LR;           " \
+                    "PUSH   {R1-R3};          " \
+                    "MOV    R1, R8;           " \
+                    "MOV    R2, R9;           " \
+                    "PUSH   {R1, R2};         " \
+                    "PUSH   {R3-R7};          " \
+                    "MOV    R1, LR;           " \
+                    "MOVS   R2, #" FAULT_STR(CLASS) "; " \
+                    "ADD    R3, SP, #4;       " \
+                    "BL     fault_dispatch;   " \
+                    "POP    {R3-R7};          " \
+                    "POP    {R1, R2};         " \
+                    "MOV    R8, R1;           " \
+                    "MOV    R9, R2;           " \
+                    "POP    {R1-R3};          " \
+                    "MOV    R10, R1;          " \
+                    "MOV    R11, R2;          " \
+                    "BX     R3;               " \
+                );
+#else
+#define FAULT_ENTRY(CLASS)	 __asm volatile \
+                ( \
+                    SELECT_STACK_FRAME \
+                    "PUSH   {R3-R11, LR};     " \
                     "MOV    R1, LR;           " \
-                    "BL     report_stack_usage; " \
+                    "MOV    R2, #" FAULT_STR(CLASS) "; " \
+                    "ADD    R3, SP, #4;       " \
+                    "BL     fault_dispatch;   " \
+                    "POP    {R3-R11, PC};     " \
+                );
+#endif
+
+/**
+ * @brief Body of a naked function that calls HANDLER with a pointer to a frame
+ * laid out like the exception stack frame: R0-R3, R12 and LR as they are,
+ * PC is the return address of the call, then xPSR. Second argument points
+ * to saved R4-R11. Returns to the caller with R0-R3 and R12 preserved.
+ */
+#ifdef ARMV6M
+/* HANDLER preserves R4-R11, so they are not reloaded. */
+#define CAPTURE_CALLER_FRAME(HANDLER)   __asm volatile \
+                ( \
+                    "SUB    SP, SP, #32;            " \
+                    "STR    R0, [SP, #0];           " \
+                    "STR    R1, [SP, #4];           " \
+                    "STR    R2, [SP, #8];           " \
+                    "STR    R3, [SP, #12];          " \
+                    "MOV    R0, R12;                " \
+                    "STR    R0, [SP, #16];          " \
+                    "MOV    R0, LR;                 " \
+                    "STR    R0, [SP, #20];          " \
+                    "STR    R0, [SP, #24];          " \
+                    "MRS    R0, XPSR;               " \
+                    "STR    R0, [SP, #28];          " \
+                    "MOV    R0, R8;                 " \
+                    "MOV    R1, R9;                 " \
+                    "MOV    R2, R10;                " \
+                    "MOV    R3, R11;                " \
+                    "PUSH   {R0-R3};                " \
+                    "PUSH   {R4-R7};                " \
+                    "MOV    R1, SP;                 " \
+                    "ADD    R0, SP, #32;            " \
+                    "BL     " #HANDLER ";           " \
+                    "ADD    SP, SP, #32;            " \
+                    "LDR    R0, [SP, #16];          " \
+                    "MOV    R12, R0;                " \
+                    "LDR    R0, [SP, #20];          " \
+                    "MOV    LR, R0;                 " \
+                    "POP    {R0-R3};                " \
+                    "ADD    SP, SP, #16;            " \
+                    "BX     LR;                     " \
+                );
+#else
+#define CAPTURE_CALLER_FRAME(HANDLER)   __asm volatile \
+                ( \
+                    "SUB    SP, SP, #8;             " \
+                    "PUSH   {R0-R3, R12, LR};       " \
+                    "MRS    R0, XPSR;               " \
+                    "STR    LR, [SP, #24];          " \
+                    "STR    R0, [SP, #28];          " \
+                    "MOV    R0, SP;                 " \
+                    "PUSH   {R4-R11};               " \
+                    "MOV    R1, SP;                 " \
+                    "BL     " #HANDLER ";           " \
+                    "POP    {R4-R11};               " \
+                    "POP    {R0-R3, R12, LR};       " \
+                    "ADD    SP, SP, #8;             " \
+                    "BX     LR;                     " \
                 );
+#endif
+
+/* Software model of the DMA hooks, runs the asynchronous copy path without a DMA channel: copies a chunk per poll. */
+#ifdef FAULT_DMA_SIM
+#ifndef FAULT_DMA_SIM_CHUNK
+#define FAULT_DMA_SIM_CHUNK     16u
+#endif
+#define FAULT_DMA_START(DST, SRC, LEN)  dma_sim_start(DST, SRC, LEN)
+#define FAULT_DMA_BUSY()                dma_sim_busy()
+#endif
+
+#if defined(ARMV6M) && defined(FAULT_MEASURE_CYCLES)
+#error "FAULT_MEASURE_CYCLES needs the DWT cycle counter, ARMv6-M has none."
+#endif
+
+#if defined(FAULT_CAPTURE_MPU) || defined(FAULT_MPU_VIRT_FIRST)
+#define MPU_REGION_MATCH
+#endif
+
+#ifdef FAULT_MPU_VIRT_FIRST
+#define MPU_VIRT_SLOTS          (FAULT_MPU_VIRT_LAST - FAULT_MPU_VIRT_FIRST + 1u)
+#endif
+
+/* Maximum number of pending copies: stack window and registered regions. */
+#ifdef FAULT_CAPTURE_REGIONS
+#define COPY_JOBS               (1u + FAULT_CAPTURE_REGIONS)
+#else
+#define COPY_JOBS               1u
+#endif
+
+/* Pipelined UART output is used when the config provides TX access instead of print functions. */
+#if defined(FAULT_UART_TX_READY) && defined(FAULT_UART_TX_WRITE) && !defined(FAULT_PRINT)
+#define FAULT_UART_PIPELINED
+
+#ifndef FAULT_UART_BUFFER_SIZE
+#define FAULT_UART_BUFFER_SIZE  64u
+#endif
+/* Head and tail run freely and wrap at 2^32, which keeps the ring consistent only for a power of two. */
+_Static_assert((FAULT_UART_BUFFER_SIZE & (FAULT_UART_BUFFER_SIZE - 1u)) == 0u,
+               "FAULT_UART_BUFFER_SIZE has to be a power of two.");
+
+#define FAULT_PRINTLN(VAR)      uart_println(VAR)
+#define FAULT_PRINT(VAR)        uart_print(VAR)
+#define FAULT_PRINT_HEX(VAR)    uart_print_hex(VAR)
+#define FAULT_NEWLINE()         uart_println("")
+#endif
+
+#ifdef FAULT_RECORD_SECTION
+#define FAULT_RECORD_ATTR   __attribute__((section(FAULT_RECORD_SECTION)))
+#else
+#define FAULT_RECORD_ATTR
+#endif
 
 /* Bit masking. */
 #define CHECK_BIT(REG, POS) ((REG) & (1u << (POS)))
 
 /* Registers */
+#ifdef ARMV6M
+/* ARMv6-M has HardFault only, without fault status registers: they read as zero. */
+#define HFSR         ((uint32_t)0u)
+#define CFSR         ((uint32_t)0u)
+#define MMFAR        ((uint32_t)0u)
+#define BFAR         ((uint32_t)0u)
+#define AFSR         ((uint32_t)0u)
+#define CFSR_CLEAR(BITS)    ((void)(BITS))
+#else
 #define HFSR         (*((uint32_t*)0xe000ed2c))
 #define CFSR         (*((uint32_t*)0xe000ed28))
 #define MMFAR        (*((uint32_t*)0xe000ed34))
 #define BFAR         (*((uint32_t*)0xe000ed38))
 #define AFSR         (*((uint32_t*)0xe000ed3c))
+#define CFSR_CLEAR(BITS)    (CFSR = (BITS))   /**< Write 1 to clear. */
+#endif
 #define AIRCR        (*((uint32_t*)0xe000ed0c))
+#define CPACR        (*((volatile uint32_t*)0xe000ed88))
+#define FPCCR        (*((volatile uint32_t*)0xe000ef34))
+#define FPCAR        (*((volatile uint32_t*)0xe000ef38))
+#define DWT_CYCCNT   (*((volatile uint32_t*)0xe0001004))
+#define MPU_TYPE     (*((volatile uint32_t*)0xe000ed90))
+#define MPU_CTRL     (*((volatile uint32_t*)0xe000ed94))
+#define MPU_RNR      (*((volatile uint32_t*)0xe000ed98))
+#define MPU_RBAR     (*((volatile uint32_t*)0xe000ed9c))
+#define MPU_RASR     (*((volatile uint32_t*)0xe000eda0))   /**< MPU_RLAR on ARMv8-M. */
+
+#if defined(__ARM_ARCH_8M_MAIN__) || defined(__ARM_ARCH_8M_BASE__) || defined(__ARM_ARCH_8_1M_MAIN__)
+#define MPU_ARMV8M
+#endif
+
+#if defined(MPU_ARMV8M) && defined(FAULT_LAZY_ZERO_REGION) && defined(FAULT_MPU_VIRT_FIRST)
+_Static_assert((FAULT_LAZY_ZERO_REGION + 1u < FAULT_MPU_VIRT_FIRST) || (FAULT_LAZY_ZERO_REGION > FAULT_MPU_VIRT_LAST),
+               "Lazy zeroing uses FAULT_LAZY_ZERO_REGION and the next region on ARMv8-M, both outside virtual regions.");
+#endif
+
+/* MPU Type Register, number of regions. */
+#define MPU_TYPE_DREGION(REG)   (((REG) >> 8) & 0xffu)
+
+/* MPU Control Register. */
+#define MPU_CTRL_ENABLE         ((uint8_t)0u)
+#define MPU_CTRL_PRIVDEFENA     ((uint8_t)2u)
+
+/* Region Attribute and Size Register (ARMv7-M). */
+#define MPU_RASR_ENABLE         ((uint8_t)0u)
+#define MPU_RASR_SIZE(REG)      (((REG) >> 1) & 0x1fu)
+#define MPU_RASR_SRD(REG)       (((REG) >> 8) & 0xffu)
+#define MPU_RASR_AP(REG)        (((REG) >> 24) & 0x7u)
+#define MPU_RASR_XN             ((uint8_t)28u)
+
+/* Region Base Address and Limit Address Registers (ARMv8-M). */
+#define MPU_RBAR_XN             ((uint8_t)0u)
+#define MPU_RBAR_AP(REG)        (((REG) >> 1) & 0x3u)
+#define MPU_RLAR_EN             ((uint8_t)0u)
+#define MPU_ADDR_MASK           ((uint32_t)0xffffffe0u)
+
+/* MemManage Fault Status Register part of CFSR, write 1 to clear. */
+#define CFSR_MMFSR_MASK         ((uint32_t)0x000000ffu)
+
+/* CPACR, full access to CP10 and CP11 (FPU). */
+#define CPACR_FPU_MASK          ((uint32_t)0x00f00000u)
+
+/* FPCCR, lazy FP state preservation is active. */
+#define FPCCR_LSPACT            ((uint8_t)0u)
+
+/* CONTROL register, thread mode is unprivileged. */
+#define CONTROL_NPRIV           ((uint8_t)0u)
+
+/* EXC_RETURN, exception returns to thread mode. */
+#define EXC_RETURN_MODE         ((uint8_t)3u)
+
+/* Access permissions decoded from a region. */
+#define ACCESS_READ             0x1u
+#define ACCESS_WRITE            0x2u
+#define ACCESS_EXEC             0x4u
+
+/* Application Interrupt and Reset Control Register, writes need VECTKEY. */
+#define AIRCR_VECTKEY       ((uint32_t)0x05fa0000)
+#define AIRCR_PRIGROUP_MASK ((uint32_t)0x00000700)
+#define AIRCR_SYSRESETREQ   ((uint8_t)2u)
 
-/* Application Interrupt and Reset Control Register */
-#define AIRCR_RESETREQ      ((uint32_t)0x05fa0040)
+/* EXC_RETURN, stack frame type: 0 - extended frame with FP state. */
+#define EXC_RETURN_FTYPE    ((uint8_t)4u)
+
+/* Stacked xPSR, set when a padding word was inserted to align the frame. */
+#define PSR_STKALIGN        ((uint8_t)9u)
+
+/* Size of FP part of the extended stack frame: S0-S15, FPSCR, reserved. */
+#define FP_FRAME_SIZE       (18u * sizeof(uint32_t))
+
+/* Stacked xPSR, IT state of the interrupted instruction: IT[1:0] in bits 26:25, IT[7:2] in bits 15:10. */
+#define PSR_IT_LO_MASK      ((uint32_t)0x06000000u)
+#define PSR_IT_HI_MASK      ((uint32_t)0x0000fc00u)
+
+/* SDIV and UDIV T1: 0xFB9n 0xFdFm and 0xFBBn 0xFdFm. */
+#define DIV_MASK            ((uint32_t)0xffd0f0f0u)
+#define DIV_VALUE           ((uint32_t)0xfb90f0f0u)
+#define DIV_RD(INSTR)       (((INSTR) >> 8) & 0xfu)
+
+/* First halfword of 32-bit Thumb instructions starts with 0b11101, 0b11110 or 0b11111. */
+#define THUMB32(HW)         (((HW) & 0xf800u) >= 0xe800u)
+
+/* UDF encodings: T1 is 0xDEii, T2 is 0xF7Fi 0xAiii. */
+#define UDF_T1_MASK         ((uint16_t)0xff00u)
+#define UDF_T1_VALUE        ((uint16_t)0xde00u)
+#define UDF_T2_MASK_HI      ((uint16_t)0xfff0u)
+#define UDF_T2_VALUE_HI     ((uint16_t)0xf7f0u)
+#define UDF_T2_MASK_LO      ((uint16_t)0xf000u)
+#define UDF_T2_VALUE_LO     ((uint16_t)0xa000u)
 
 /* Hard Fault Status Register. */
 #define FORCED              ((uint8_t)30u)
@@ -76,190 +375,2744 @@
 #define INVSTATE            ((uint8_t)17u)
 #define UNDEFINSTR          ((uint8_t)16u)
 
+#ifdef FAULT_SINK_WRITEV
+#define DEFAULT_SINKS   (FAULT_SINK_REPORT | FAULT_SINK_DECODE | FAULT_SINK_BINARY)
+#else
+#define DEFAULT_SINKS   (FAULT_SINK_REPORT | FAULT_SINK_DECODE)
+#endif
+
+/* Handling policies, application entries first, defaults last. */
+static const fault_policy_t policy_table[] = {
+#ifdef FAULT_POLICY_TABLE
+    FAULT_POLICY_TABLE
+#endif
+    FAULT_POLICY(FAULT_CLASS_NESTED, 0u, FAULT_DEPTH_NONE, 0u, 1u, FAULT_ACTION_DEFAULT),
+    FAULT_POLICY(FAULT_CLASS_HARD, 0u, FAULT_DEPTH_FULL,
+                 DEFAULT_SINKS, 1u, FAULT_ACTION_DEFAULT),
+    FAULT_POLICY(FAULT_CLASS_BUS, 0u, FAULT_DEPTH_FULL,
+                 DEFAULT_SINKS, 1u, FAULT_ACTION_DEFAULT),
+    FAULT_POLICY(FAULT_CLASS_ANY, 0u, FAULT_DEPTH_REGS | FAULT_DEPTH_STACK | FAULT_DEPTH_MPU,
+                 DEFAULT_SINKS, 1u, FAULT_ACTION_DEFAULT),
+};
+
+fault_record_t fault_record FAULT_RECORD_ATTR;
+
+/* Set while a fault is being handled, to detect nested faults. */
+static volatile uint32_t fault_in_progress;
+#ifdef FAULT_BACKUP_WORDS
+/* Set once the backup summary holds the current crash, a nested fault must not count it again. */
+static volatile uint32_t backup_stored;
+#endif
+
+/**
+ * @brief Memory copy into the record, done by CPU or by DMA in background.
+ */
+typedef struct {
+    void *dst;
+    const void *src;
+    uint32_t len;
+} copy_job_t;
+
+/**
+ * @brief Copies queued for one record.
+ */
+typedef struct {
+    copy_job_t job[COPY_JOBS];
+    uint32_t count;
+    uint32_t next;          /**< First job not started yet. */
+} copy_list_t;
+
+/* Fault and snapshot paths have their own lists, so a fault during a snapshot leaves its copies alone. */
+static copy_list_t fault_copies;
+#ifdef FAULT_SNAPSHOT_SLOTS
+static copy_list_t snapshot_copies;
+#endif
+
+#ifdef FAULT_CAPTURE_REGIONS
+static fault_region_t capture_regions[FAULT_CAPTURE_REGIONS];
+static uint32_t capture_region_count;
+#endif
+
+#ifdef FAULT_IMAGE_SLOTS
+static fault_image_t images[FAULT_IMAGE_SLOTS];
+static uint32_t image_count;
+#endif
+
+#ifdef FAULT_SNAPSHOT_SLOTS
+fault_record_t fault_snapshots[FAULT_SNAPSHOT_SLOTS] FAULT_RECORD_ATTR;
+
+/* Slot that receives the next snapshot. */
+static uint32_t fault_snapshot_next;
+
+/**
+ * @brief   Captures a snapshot into the next slot of fault_snapshots.
+ * Should be invoked from fault_snapshot_now() only.
+ * @param   *stack_frame: Frame built by fault_snapshot_now(), R0 holds the tag.
+ * @param   *callee: Saved R4-R11.
+ * @return  void
+ */
+void
+capture_snapshot(uint32_t *stack_frame, uint32_t *callee);
+#endif
+
 /**
- * @brief   Prints the registers and gives detailed information about the error(s).
- * Should be invked from REPORT_STACK_FRAME macro.
+ * @brief   Captures the fault and handles it according to the policy of its class.
+ * Should be invoked from FAULT_ENTRY macro.
  * @param   *stack_frame: Stack frame registers (R0-R3, R12, LR, LC, PSR).
  * @param   exc: EXC_RETURN register.
+ * @param   fault_class: One of FAULT_CLASS_*.
+ * @param   *callee: R4-R11 saved by FAULT_ENTRY.
+ * @return  void, only if the policy action is FAULT_ACTION_RETURN.
+ */
+void
+fault_dispatch(uint32_t *stack_frame, uint32_t exc, uint32_t fault_class, uint32_t *callee);
+
+/**
+ * @brief   Captures a software fault and handles it according to the policy.
+ * Should be invoked from fault_capture_soft() only.
+ * @param   *stack_frame: Frame built by fault_capture_soft(), R0-R2 hold its arguments.
+ * @param   *callee: Saved R4-R11.
  * @return  void
  */
 void
-report_stack_usage(uint32_t *stack_frame, uint32_t exc);
+report_soft_fault(uint32_t *stack_frame, uint32_t *callee);
 
 /**
- * @brief  Print data about CFSR bits that relevant to memory management fault
+ * @brief  Try to resolve the fault without reporting it
+ * @return Non-zero if the interrupted code can be resumed.
  */
-static void
-report_memmanage_fault(void);
+static int
+recover_fault(uint32_t *stack_frame, uint32_t exc, uint32_t fault_class, uint32_t *callee);
 
 /**
- * @brief  Print data about CFSR bits that relevant to bus fault
+ * @brief  Check whether the code that has been interrupted runs privileged
  */
-static void
-report_bus_fault(void);
+static int
+is_privileged(uint32_t exc);
 
+#ifdef MPU_REGION_MATCH
 /**
- * @brief  Print data about CFSR bits that relevant to usage fault
+ * @brief  Check whether the MPU region covers the address and decode its permissions
  */
-static void
-report_usage_fault(void);
+static int
+mpu_region_match(uint32_t rbar, uint32_t rasr, uint32_t address, int privileged, uint32_t *access);
+#endif
 
 /**
- * @brief  Print data about HFSR bits
+ * @brief  Zero the block of the lazily zeroed section that has been accessed first time
+ * @return Non-zero if the block has been zeroed and the access can be retried.
  */
-static void
-report_hard_fault(void);
+static int
+lazy_zero_recover(uint32_t address);
 
 /**
- * @brief Trigger breakpoint if debugger is connected.
- * Infinite loop if no debugger connected.
+ * @brief  Enable the FPU for the current task on its first FP instruction
+ * @return Non-zero if the FPU has been enabled and the instruction can be retried.
  */
-static inline void
-halt_execution(void)
-{
-#ifdef FAULT_BREAKPOINT
-    /* Breakpoint*/
-    __asm volatile("BKPT #0");
-#endif
+static int
+lazy_fpu_recover(uint32_t exc);
 
-#ifdef FAULT_REBOOT
-    /* Reboot system */
-    AIRCR = AIRCR_RESETREQ;
-#endif
+/**
+ * @brief  Emulate the undefined or coprocessor instruction with the matching dispatch table handler
+ * @param  cause: CFSR bit of the fault, UNDEFINSTR or NOCP.
+ * @return Non-zero if the instruction has been emulated and execution can resume after it.
+ */
+static int
+emulate_recover(uint32_t *stack_frame, uint32_t exc, uint32_t *callee, uint32_t cause);
 
-#ifdef FAULT_STOP
-    /* Infinite loop to stop the execution. */
-    while(1);
-#endif
-}
+/**
+ * @brief  Write FAULT_DIV0_RESULT to the destination of the faulting division and count it
+ * @return Non-zero if execution can resume after the division.
+ */
+static int
+div0_recover(uint32_t *stack_frame, uint32_t *callee);
 
+/**
+ * @brief  Perform the faulting unaligned load or store with byte accesses and count it
+ * @return Non-zero if execution can resume after the instruction.
+ */
+static int
+unaligned_recover(uint32_t *stack_frame, uint32_t exc, uint32_t *callee);
 
-#ifdef MEMMANAGE_FAULT_SYMBOL
-void
-MEMMANAGE_FAULT_SYMBOL(void)
-{
-    REPORT_STACK_FRAME
-    report_memmanage_fault();
-#ifdef MEMMANAGE_FAULT_HOOK
-    MEMMANAGE_FAULT_HOOK()
-#endif
-    halt_execution();
-}
-#endif
+/**
+ * @brief  Count an event at the PC in the first free or matching slot
+ * @return Non-zero if all slots are taken by other addresses.
+ */
+static int
+count_pc(uint32_t *pcs, uint32_t *counts, uint32_t slots, uint32_t pc);
 
-#ifdef HARD_FAULT_SYMBOL
-void
-HARD_FAULT_SYMBOL(void)
-{
-    REPORT_STACK_FRAME
-    report_memmanage_fault();
-    report_bus_fault();
-    report_usage_fault();
-    report_hard_fault();
-#ifdef HARD_FAULT_HOOK
-    HARD_FAULT_HOOK()
-#endif
-    halt_execution();
-}
+#if defined(FAULT_DIV0_RESULT) || defined(FAULT_UNALIGNED_EMULATE)
+/**
+ * @brief  Zero retained counters unless they start with FAULT_STATS_MAGIC
+ * @param  words: Size of the counters including the magic, in words.
+ */
+static void
+stats_validate(uint32_t *stats, uint32_t words);
 #endif
 
-#ifdef BUS_FAULT_SYMBOL
-void
-BUS_FAULT_SYMBOL(void)
-{
-    REPORT_STACK_FRAME
-    report_bus_fault();
-#ifdef BUS_FAULT_HOOK
-    BUS_FAULT_HOOK()
-#endif
-    halt_execution();
-}
-#endif
+/**
+ * @brief  Check that the instruction at a stacked PC can be read inside the handler
+ * @return Non-zero if it is within FAULT_CODE_START - FAULT_CODE_END, or those are not defined.
+ */
+static int
+code_readable(uint32_t pc);
 
-#ifdef USAGE_FAULT_SYMBOL
-void
-USAGE_FAULT_SYMBOL(void)
-{
-    REPORT_STACK_FRAME
-    report_usage_fault();
-#ifdef USAGE_FAULT_HOOK
-    USAGE_FAULT_HOOK()
-#endif
-    halt_execution();
-}
+/**
+ * @brief  Write a register of the interrupted code, SP and PC are not written
+ */
+static void
+frame_set_reg(uint32_t *stack_frame, uint32_t *callee, uint32_t reg, uint32_t value);
+
+/**
+ * @brief  Move the stacked PC past the instruction and advance IT state
+ * @param  size: Instruction size in bytes.
+ */
+static void
+advance_pc(uint32_t *stack_frame, uint32_t size);
+
+#ifdef FAULT_EMULATE_SLOTS
+/**
+ * @brief  Evaluate the IT block condition of the interrupted instruction against the stacked flags
+ * @return Non-zero if the instruction executes: outside an IT block, or its condition passed.
+ */
+static int
+it_condition_passed(uint32_t psr);
 #endif
 
-void
-report_stack_usage(uint32_t *stack_frame, uint32_t exc)
-{
-    uint32_t r0   = stack_frame[0];
-    uint32_t r1   = stack_frame[1];
-    uint32_t r2   = stack_frame[2];
-    uint32_t r3   = stack_frame[3];
-    uint32_t r12  = stack_frame[4];
-    uint32_t lr   = stack_frame[5];
-    uint32_t pc   = stack_frame[6];
-    uint32_t psr  = stack_frame[7];
-    uint32_t hfsr = HFSR;
-    uint32_t cfsr = CFSR;
-    uint32_t mmar = MMFAR;
-    uint32_t bfar = BFAR;
-    uint32_t afsr = AFSR;
-    FAULT_PRINTLN("!!!Fault detected!!!");
+/**
+ * @brief  SP of the interrupted code, above the stack frame
+ */
+static uint32_t
+frame_sp(const uint32_t *stack_frame, uint32_t exc);
 
-    FAULT_PRINTLN("Stack frame:");
-    FAULT_PRINT("R0 :    "); FAULT_PRINT_HEX(r0); FAULT_NEWLINE();
-    FAULT_PRINT("R1 :    "); FAULT_PRINT_HEX(r1); FAULT_NEWLINE();
-    FAULT_PRINT("R2 :    "); FAULT_PRINT_HEX(r2); FAULT_NEWLINE();
-    FAULT_PRINT("R3 :    "); FAULT_PRINT_HEX(r3); FAULT_NEWLINE();
-    FAULT_PRINT("R12:    "); FAULT_PRINT_HEX(r12); FAULT_NEWLINE();
-    FAULT_PRINT("LR :    "); FAULT_PRINT_HEX(lr); FAULT_NEWLINE();
-    FAULT_PRINT("PC :    "); FAULT_PRINT_HEX(pc); FAULT_NEWLINE();
-    FAULT_PRINT("PSR:    "); FAULT_PRINT_HEX(psr); FAULT_NEWLINE();
+/**
+ * @brief  Load the logical MPU region allowing access to address into a hardware region
+ * @return Non-zero if a region has been loaded and the access can be retried.
+ */
+static int
+mpu_virt_recover(uint32_t address, uint32_t exc);
 
-    FAULT_PRINTLN("Fault status:");
-    FAULT_PRINT("HFSR:    "); FAULT_PRINT_HEX(hfsr); FAULT_NEWLINE();
-    FAULT_PRINT("CFSR:    "); FAULT_PRINT_HEX(cfsr); FAULT_NEWLINE();
-    FAULT_PRINT("MMAR:    "); FAULT_PRINT_HEX(mmar); FAULT_NEWLINE();
-    FAULT_PRINT("BFAR:    "); FAULT_PRINT_HEX(bfar); FAULT_NEWLINE();
-    FAULT_PRINT("AFSR:    "); FAULT_PRINT_HEX(afsr); FAULT_NEWLINE();
+/**
+ * @brief  Find the policy for the fault class and CFSR value
+ */
+static const fault_policy_t *
+find_policy(uint32_t fault_class, uint32_t cfsr);
 
-    FAULT_PRINTLN("Other:");
-    FAULT_PRINT("EXC_RETURN: "); FAULT_PRINT_HEX(exc); FAULT_NEWLINE();
-}
+/**
+ * @brief  Print, persist and finish the captured fault as the policy says
+ * @param  *policy: Policy of the fault.
+ * @param  handler_class: Class of the handler that has been entered.
+ * @param  cfsr: CFSR bits of the fault, cleared if execution resumes.
+ */
+static void
+handle_fault(const fault_policy_t *policy, uint32_t handler_class, uint32_t cfsr);
 
+/**
+ * @brief  Fill the record with the stack frame, fault status registers and
+ * the optional parts selected by depth (FAULT_DEPTH_* flags)
+ */
 static void
-report_memmanage_fault(void)
-{
-    uint32_t cfsr = CFSR;
+capture_record(fault_record_t *record, copy_list_t *copies, uint32_t *stack_frame, uint32_t *callee,
+               uint32_t exc, uint32_t fault_class, uint32_t depth);
 
-    FAULT_PRINTLN("MemManage fault status:");
+/**
+ * @brief  Number of stack words above record->sp that can be safely read
+ */
+static uint32_t
+stack_window_words(const fault_record_t *record);
 
-    if (CHECK_BIT(cfsr, MMARVALID)) {
-        FAULT_PRINTLN(" - MMAR holds a valid address.");
-    } else {
-        FAULT_PRINTLN(" - MMAR holds an invalid address.");
-    }
+/**
+ * @brief  Queue copy of stack contents above record->sp into record->stack
+ */
+static void
+capture_stack_window(fault_record_t *record, copy_list_t *copies);
 
-    if (CHECK_BIT(cfsr, MLSPERR)) {
-        FAULT_PRINTLN(" - Fault occurred during floating-point lazy state preservation.");
-    }
+/**
+ * @brief  Queue copies of registered regions into record->region_data
+ */
+static void
+capture_regions_queue(fault_record_t *record, copy_list_t *copies);
 
-    if (CHECK_BIT(cfsr, MSTKERR)) {
-        FAULT_PRINTLN(" - Stacking has caused an access violation.");
-    }
+/**
+ * @brief  Queue a copy into the record
+ */
+static void
+copy_queue(copy_list_t *copies, void *dst, const void *src, uint32_t len);
 
-    if (CHECK_BIT(cfsr, MUNSTKERR)) {
-        FAULT_PRINTLN(" - Unstacking has caused an access violation.");
-    }
+/**
+ * @brief  Start queued copies. Without DMA they are done right away.
+ */
+static void
+copy_start(copy_list_t *copies);
 
-    if (CHECK_BIT(cfsr, DACCVIOL)) {
-        FAULT_PRINTLN(" - Load or store at a location that does not permit the operation.");
-    }
+/**
+ * @brief  Start the next queued copy if DMA is idle, it may still run a copy of another list
+ */
+static void
+copy_pump(copy_list_t *copies);
 
-    if (CHECK_BIT(cfsr, IACCVIOL)) {
-        FAULT_PRINTLN(" - Instruction fetch from a location that does not permit execution.");
-    }
+/**
+ * @brief  Wait until all queued copies are done
+ */
+static void
+copy_join(copy_list_t *copies);
+
+/**
+ * @brief  Read registers listed in fault_periph_table into record->periph
+ */
+static void
+capture_periph(fault_record_t *record);
+
+/**
+ * @brief  Store MPU configuration into the record
+ */
+static void
+capture_mpu(fault_record_t *record);
+
+#ifdef FAULT_CAPTURE_FP
+/**
+ * @brief  Store FP state of the interrupted code, from the stack frame or from pending lazy preservation
+ */
+static void
+capture_fp(fault_record_t *record, const uint32_t *stack_frame, uint32_t exc);
+#endif
+
+/**
+ * @brief  Check if undefined instruction is a FAULT_CHECK() trap and record its ID
+ */
+static void
+capture_check_trap(fault_record_t *record);
+
+/**
+ * @brief  Print registers stored in fault_record
+ */
+static void
+report_record(void);
+
+/**
+ * @brief  Print stack window stored in fault_record
+ */
+static void
+report_stack_window(void);
+
+#ifdef FAULT_RECORD_TLV
+/* Segments of a TLV record: header, and per section its header, up to 3 value parts and padding.
+ * Every section type is present at most once. */
+#define TLV_SECTIONS        FAULT_TLV_LAST
+#define TLV_SEGMENTS        (1u + TLV_SECTIONS * 5u)
+
+/**
+ * @brief TLV record as a list of segments pointing into the record.
+ */
+typedef struct {
+    fault_tlv_header_t header;
+    fault_tlv_t tag[TLV_SECTIONS];
+    fault_iovec_t iov[TLV_SEGMENTS];
+    uint32_t sections;
+    uint32_t segments;
+} tlv_builder_t;
+
+/**
+ * @brief  Build TLV segments of the record
+ */
+static void
+tlv_build(tlv_builder_t *builder, const fault_record_t *record);
+#endif
+
+/**
+ * @brief  Pass header, record and stack window to FAULT_SINK_WRITEV as separate segments
+ */
+static void
+write_record(void);
+
+/**
+ * @brief  Print fault status analysis of the handler class
+ */
+static void
+report_decode(uint32_t handler_class);
+
+/**
+ * @brief  Print data about CFSR bits that relevant to memory management fault
+ */
+static void
+report_memmanage_fault(void);
+
+/**
+ * @brief  Print captured MPU regions covering the faulting address
+ * @param  address: Address of the access that has caused the fault.
+ */
+static void
+report_mpu_regions(uint32_t address);
+
+/**
+ * @brief  Print data about CFSR bits that relevant to bus fault
+ */
+static void
+report_bus_fault(void);
+
+/**
+ * @brief  Print data about CFSR bits that relevant to usage fault
+ */
+static void
+report_usage_fault(void);
+
+/**
+ * @brief  Print data about HFSR bits
+ */
+static void
+report_hard_fault(void);
+
+#ifdef FAULT_UART_PIPELINED
+/* Formatted characters waiting for the TX FIFO. */
+static char uart_buffer[FAULT_UART_BUFFER_SIZE];
+static uint32_t uart_head;
+static uint32_t uart_tail;
+
+/**
+ * @brief Move buffered characters to the TX FIFO while it has room, without waiting.
+ */
+static inline void
+uart_pump(void)
+{
+    while ((uart_tail != uart_head) && FAULT_UART_TX_READY()) {
+        FAULT_UART_TX_WRITE(uart_buffer[uart_tail & (FAULT_UART_BUFFER_SIZE - 1u)]);
+        uart_tail++;
+    }
+}
+
+/**
+ * @brief Queue one formatted character. Waits only if the buffer is full,
+ * otherwise formatting of the next character overlaps with transmission.
+ */
+static void
+uart_put(char c)
+{
+    while ((uart_head - uart_tail) >= FAULT_UART_BUFFER_SIZE) {
+        uart_pump();
+    }
+    uart_buffer[uart_head & (FAULT_UART_BUFFER_SIZE - 1u)] = c;
+    uart_head++;
+    uart_pump();
+}
+
+static void
+uart_print(const char *str)
+{
+    while (*str) {
+        uart_put(*str++);
+    }
+}
+
+static void
+uart_println(const char *str)
+{
+    uart_print(str);
+    uart_put('\r');
+    uart_put('\n');
+}
+
+static void
+uart_print_hex(uint32_t value)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    int shift;
+
+    uart_put('0');
+    uart_put('x');
+    for (shift = 28; shift >= 0; shift -= 4) {
+        uart_put(digits[(value >> shift) & 0xfu]);
+    }
+}
+
+/**
+ * @brief Wait until everything formatted has been handed over to the TX FIFO.
+ */
+static void
+uart_flush(void)
+{
+    while (uart_tail != uart_head) {
+        uart_pump();
+    }
+#ifdef FAULT_UART_TX_DONE
+    while (!FAULT_UART_TX_DONE());
+#endif
+}
+#endif
+
+#ifdef FAULT_RESET_CAUSE
+/* Retained handler state, tagged so RAM contents after power-on do not pass for a state. */
+#define HANDLER_STATE_TAG   ((uint32_t)0xfa01a000u)
+#define HANDLER_STATE_MASK  ((uint32_t)0xfffff000u)
+
+static volatile uint32_t handler_state FAULT_RECORD_ATTR;
+
+void
+fault_reset_attribute(fault_reset_info_t *info)
+{
+    uint32_t state = ((handler_state & HANDLER_STATE_MASK) == HANDLER_STATE_TAG)
+                     ? (handler_state & ~HANDLER_STATE_MASK) : FAULT_HANDLER_IDLE;
+
+    info->hw_cause = (uint32_t)(FAULT_RESET_CAUSE());
+    info->cause    = info->hw_cause;
+    if ((info->hw_cause == FAULT_RESET_POWER_ON) || (info->hw_cause == FAULT_RESET_BROWNOUT)) {
+        /* Retained RAM did not survive. */
+        state = FAULT_HANDLER_IDLE;
+        info->record_valid = 0u;
+    } else {
+        info->record_valid = (fault_record.magic == FAULT_RECORD_MAGIC);
+        if (state == FAULT_HANDLER_RESET) {
+            info->cause = FAULT_RESET_HANDLER;
+        } else if ((state == FAULT_HANDLER_RUNNING) && (info->hw_cause == FAULT_RESET_WATCHDOG)) {
+            info->cause = FAULT_RESET_HANDLER_CUT;
+        }
+    }
+    info->handler_state = state;
+    handler_state = HANDLER_STATE_TAG | FAULT_HANDLER_IDLE;
+}
+#endif
+
+/**
+ * @brief Store the handler state that survives reset, if reset cause attribution is enabled.
+ */
+static inline void
+set_handler_state(uint32_t state)
+{
+#ifdef FAULT_RESET_CAUSE
+    handler_state = HANDLER_STATE_TAG | state;
+#else
+    (void)state;
+#endif
+}
+
+/**
+ * @brief Request system reset, leaving the reason for fault_reset_attribute().
+ */
+static inline void
+request_reset(void)
+{
+    set_handler_state(FAULT_HANDLER_RESET);
+    __asm volatile("DSB" : : : "memory");
+    AIRCR = AIRCR_VECTKEY | (AIRCR & AIRCR_PRIGROUP_MASK) | (1u << AIRCR_SYSRESETREQ);
+    __asm volatile("DSB" : : : "memory");
+}
+
+/**
+ * @brief Trigger breakpoint if debugger is connected.
+ * Infinite loop if no debugger connected.
+ * Default action of the policy table.
+ */
+static inline void
+halt_execution(void)
+{
+#ifdef FAULT_BREAKPOINT
+    /* Breakpoint*/
+    __asm volatile("BKPT #0");
+#endif
+
+#ifdef FAULT_REBOOT
+    /* Reboot system */
+    request_reset();
+#endif
+
+#ifdef FAULT_STOP
+    /* Infinite loop to stop the execution. */
+    while(1);
+#endif
+}
+
+#ifdef FAULT_BACKUP_WORDS
+/* Backup registers used: magic, class and count, PC, LR, CFSR, signature and checksum, then optional fields. */
+#define BACKUP_WORDS        ((FAULT_BACKUP_WORDS > 11u) ? 11u : FAULT_BACKUP_WORDS)
+
+/**
+ * @brief  16-bit checksum of the summary words, the lower half of word 4 counts as zero
+ */
+static uint32_t
+backup_checksum(const uint32_t *words)
+{
+    uint32_t sum = 0u;
+    uint32_t i;
+
+    for (i = 0u; i < BACKUP_WORDS; i++) {
+        uint32_t word = (i == 4u) ? (words[i] & 0xffff0000u) : words[i];
+
+        sum += (word & 0xffffu) + (word >> 16) + i;
+    }
+    sum = (sum & 0xffffu) + (sum >> 16);
+    sum = (sum & 0xffffu) + (sum >> 16);
+    return ~sum & 0xffffu;
+}
+
+/**
+ * @brief  Read the summary words, return non-zero if they are valid
+ */
+static int
+backup_load(uint32_t *words)
+{
+    uint32_t i;
+
+    for (i = 0u; i < BACKUP_WORDS; i++) {
+        words[i] = FAULT_BACKUP_READ(i);
+    }
+    return ((words[0] >> 16) == FAULT_BACKUP_MAGIC) && ((words[4] & 0xffffu) == backup_checksum(words));
+}
+
+/**
+ * @brief  Pack the record into the backup registers
+ */
+static void
+backup_store(const fault_record_t *record)
+{
+    const uint32_t fields[] = {
+        record->frame.pc, record->frame.lr, record->cfsr, 0u,
+        record->code, record->file_id, record->line, record->hfsr, record->mmfar, record->bfar
+    };
+    uint32_t words[11];
+    uint32_t count = 0u;
+    uint32_t signature = 2166136261u;
+    uint32_t i;
+
+    if (backup_load(words)) {
+        count = words[0] & 0xffu;
+    }
+    if (count < 0xffu) {
+        count++;
+    }
+
+    /* FNV-1a of the fields that identify the crash site. */
+    for (i = 0u; i < 7u; i++) {
+        signature ^= (i == 3u) ? record->fault_class : fields[i];
+        signature *= 16777619u;
+    }
+
+    words[0] = ((uint32_t)FAULT_BACKUP_MAGIC << 16) | ((record->fault_class & 0xffu) << 8) | count;
+    for (i = 1u; i < BACKUP_WORDS; i++) {
+        words[i] = fields[i - 1u];
+    }
+    /* Upper half of the signature shares the word with the checksum. */
+    words[4] = signature & 0xffff0000u;
+    words[4] |= backup_checksum(words);
+    for (i = 0u; i < BACKUP_WORDS; i++) {
+        FAULT_BACKUP_WRITE(i, words[i]);
+    }
+}
+
+int
+fault_backup_read(fault_backup_summary_t *summary)
+{
+    uint32_t words[11] = { 0u };
+
+    if (!backup_load(words)) {
+        return -1;
+    }
+    summary->fault_class = (words[0] >> 8) & 0xffu;
+    summary->count       = words[0] & 0xffu;
+    summary->pc          = words[1];
+    summary->lr          = words[2];
+    summary->cfsr        = words[3];
+    summary->signature   = words[4] & 0xffff0000u;
+    summary->code        = words[5];
+    summary->file_id     = words[6];
+    summary->line        = words[7];
+    summary->hfsr        = words[8];
+    summary->mmfar       = words[9];
+    summary->bfar        = words[10];
+    return 0;
+}
+
+void
+fault_backup_clear(void)
+{
+    FAULT_BACKUP_WRITE(0u, 0u);
+}
+#endif
+
+/**
+ * @brief Hand the filled record over to the persistence hook and backup registers, if any.
+ */
+static inline void
+persist_record(void)
+{
+#ifdef FAULT_BACKUP_WORDS
+    if (!backup_stored) {
+        backup_store(&fault_record);
+        backup_stored = 1u;
+    }
+#endif
+#ifdef FAULT_PERSIST_HOOK
+    FAULT_PERSIST_HOOK(&fault_record)
+#endif
+}
+
+#ifdef MEMMANAGE_FAULT_SYMBOL
+__attribute__((naked)) void
+MEMMANAGE_FAULT_SYMBOL(void)
+{
+    FAULT_ENTRY(FAULT_CLASS_MEMMANAGE)
+}
+#endif
+
+#ifdef HARD_FAULT_SYMBOL
+__attribute__((naked)) void
+HARD_FAULT_SYMBOL(void)
+{
+    FAULT_ENTRY(FAULT_CLASS_HARD)
+}
+#endif
+
+#ifdef BUS_FAULT_SYMBOL
+__attribute__((naked)) void
+BUS_FAULT_SYMBOL(void)
+{
+    FAULT_ENTRY(FAULT_CLASS_BUS)
+}
+#endif
+
+#ifdef USAGE_FAULT_SYMBOL
+__attribute__((naked)) void
+USAGE_FAULT_SYMBOL(void)
+{
+    FAULT_ENTRY(FAULT_CLASS_USAGE)
+}
+#endif
+
+#ifdef HANG_SYMBOL
+__attribute__((naked)) void
+HANG_SYMBOL(void)
+{
+    FAULT_ENTRY(FAULT_CLASS_HANG)
+}
+#endif
+
+#ifdef FAULT_PROFILER_SAMPLES
+/* Single writer (sampling interrupt) / single reader (fault_profiler_read) ring. */
+static fault_profiler_sample_t fault_profiler_ring[FAULT_PROFILER_SAMPLES];
+static volatile uint32_t fault_profiler_head;
+static volatile uint32_t fault_profiler_tail;
+
+fault_profiler_stats_t fault_profiler_stats;
+
+/**
+ * @brief   Stores interrupted PC and LR into the profiler ring.
+ * Should be invoked from FAULT_PROFILER_SYMBOL only, returns from the interrupt.
+ * @param   *stack_frame: Stack frame of the interrupted code.
+ * @param   exc: EXC_RETURN register.
+ * @return  void
+ */
+void
+fault_profiler_sample(uint32_t *stack_frame, uint32_t exc);
+
+#ifdef FAULT_PROFILER_SYMBOL
+__attribute__((naked)) void
+FAULT_PROFILER_SYMBOL(void)
+{
+    /* Same frame selection as fault handlers; tail call keeps EXC_RETURN in LR. */
+    __asm volatile
+    (
+        SELECT_STACK_FRAME
+        "MOV    R1, LR;           "
+#ifdef ARMV6M
+        /* B reaches only 2 KB on ARMv6-M, POP of EXC_RETURN into PC returns from the interrupt. */
+        "PUSH   {R1, LR};         "
+        "BL     fault_profiler_sample; "
+        "POP    {R1, PC};         "
+#else
+        "B      fault_profiler_sample; "
+#endif
+    );
+}
+#endif
+
+void
+fault_profiler_sample(uint32_t *stack_frame, uint32_t exc)
+{
+    uint32_t head = fault_profiler_head;
+#ifdef FAULT_MEASURE_CYCLES
+    uint32_t start = DWT_CYCCNT;
+    uint32_t cycles;
+#endif
+
+    (void)exc;
+#ifdef FAULT_PROFILER_HOOK
+    FAULT_PROFILER_HOOK()
+#endif
+    if ((head - fault_profiler_tail) < FAULT_PROFILER_SAMPLES) {
+        fault_profiler_ring[head % FAULT_PROFILER_SAMPLES].pc = stack_frame[6];
+        fault_profiler_ring[head % FAULT_PROFILER_SAMPLES].lr = stack_frame[5];
+        /* Sample is complete before the reader can see it. */
+        __asm volatile("DMB" : : : "memory");
+        fault_profiler_head = head + 1u;
+        fault_profiler_stats.samples++;
+    } else {
+        fault_profiler_stats.dropped++;
+    }
+#ifdef FAULT_MEASURE_CYCLES
+    cycles = DWT_CYCCNT - start;
+    if (cycles > fault_profiler_stats.cycles_max) {
+        fault_profiler_stats.cycles_max = cycles;
+    }
+#endif
+}
+
+uint32_t
+fault_profiler_read(fault_profiler_sample_t *samples, uint32_t max)
+{
+    uint32_t tail = fault_profiler_tail;
+    uint32_t count = 0u;
+
+    while ((count < max) && (tail != fault_profiler_head)) {
+        samples[count++] = fault_profiler_ring[tail % FAULT_PROFILER_SAMPLES];
+        tail++;
+    }
+    /* Slots are copied out before the writer may reuse them. */
+    __asm volatile("DMB" : : : "memory");
+    fault_profiler_tail = tail;
+    return count;
+}
+#endif
+
+void
+fault_dispatch(uint32_t *stack_frame, uint32_t exc, uint32_t fault_class, uint32_t *callee)
+{
+    uint32_t handler_class = fault_class;
+    const fault_policy_t *policy;
+    uint32_t cfsr;
+
+    if (!fault_in_progress && recover_fault(stack_frame, exc, fault_class, callee)) {
+        return;
+    }
+
+    if (fault_in_progress) {
+        fault_class = FAULT_CLASS_NESTED;
+    }
+#ifdef FAULT_BACKUP_WORDS
+    if (!fault_in_progress) {
+        backup_stored = 0u;
+    }
+#endif
+    fault_in_progress = 1u;
+    set_handler_state(FAULT_HANDLER_RUNNING);
+
+    cfsr = CFSR;
+    policy = find_policy(fault_class, cfsr);
+    if (policy->depth != FAULT_DEPTH_NONE) {
+        capture_record(&fault_record, &fault_copies, stack_frame, callee, exc, fault_class, policy->depth);
+    }
+    handle_fault(policy, handler_class, cfsr);
+}
+
+/* Arguments are passed on in R0-R2 by the assembly, the compiler does not see them used. */
+__attribute__((naked)) void
+fault_capture_soft(__attribute__((unused)) uint32_t code, __attribute__((unused)) uint32_t file_id,
+                   __attribute__((unused)) uint32_t line)
+{
+    CAPTURE_CALLER_FRAME(report_soft_fault)
+}
+
+void
+report_soft_fault(uint32_t *stack_frame, uint32_t *callee)
+{
+    uint32_t fault_class = fault_in_progress ? FAULT_CLASS_NESTED : FAULT_CLASS_SOFTWARE;
+    const fault_policy_t *policy = find_policy(fault_class, 0u);
+
+#ifdef FAULT_BACKUP_WORDS
+    if (!fault_in_progress) {
+        backup_stored = 0u;
+    }
+#endif
+    fault_in_progress = 1u;
+    set_handler_state(FAULT_HANDLER_RUNNING);
+    if (policy->depth != FAULT_DEPTH_NONE) {
+        capture_record(&fault_record, &fault_copies, stack_frame, callee, 0u, fault_class, policy->depth);
+        fault_record.code    = stack_frame[0];
+        fault_record.file_id = stack_frame[1];
+        fault_record.line    = stack_frame[2];
+    }
+    handle_fault(policy, FAULT_CLASS_SOFTWARE, 0u);
+}
+
+static int
+recover_fault(uint32_t *stack_frame, uint32_t exc, uint32_t fault_class, uint32_t *callee)
+{
+    uint32_t cfsr = CFSR;
+
+    if (fault_class == FAULT_CLASS_MEMMANAGE) {
+        if (CHECK_BIT(cfsr, DACCVIOL) && CHECK_BIT(cfsr, MMARVALID)) {
+            return lazy_zero_recover(MMFAR) || mpu_virt_recover(MMFAR, exc);
+        }
+        /* Instruction fetch, lazily zeroed memory is never executed. */
+        if (CHECK_BIT(cfsr, IACCVIOL)) {
+            return mpu_virt_recover(stack_frame[6], exc);
+        }
+    } else if ((fault_class == FAULT_CLASS_USAGE) && CHECK_BIT(cfsr, NOCP)) {
+        /* FP instructions raise NOCP on cores without FPU too, there they can only be emulated. */
+        return lazy_fpu_recover(exc) || emulate_recover(stack_frame, exc, callee, NOCP);
+    } else if ((fault_class == FAULT_CLASS_USAGE) && CHECK_BIT(cfsr, UNDEFINSTR)) {
+        return emulate_recover(stack_frame, exc, callee, UNDEFINSTR);
+    } else if ((fault_class == FAULT_CLASS_USAGE) && CHECK_BIT(cfsr, DIVBYZERO)) {
+        return div0_recover(stack_frame, callee);
+    } else if ((fault_class == FAULT_CLASS_USAGE) && CHECK_BIT(cfsr, UNALIGNED)) {
+        return unaligned_recover(stack_frame, exc, callee);
+    }
+#ifdef ARMV6M
+    /* Unaligned accesses go to HardFault without a cause, the decoder checks the address. */
+    if (fault_class == FAULT_CLASS_HARD) {
+        return unaligned_recover(stack_frame, exc, callee);
+    }
+#endif
+    return 0;
+}
+
+static int
+count_pc(uint32_t *pcs, uint32_t *counts, uint32_t slots, uint32_t pc)
+{
+    uint32_t i;
+
+    for (i = 0u; i < slots; i++) {
+        if ((pcs[i] == pc) || (pcs[i] == 0u)) {
+            pcs[i] = pc;
+            counts[i]++;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#if defined(FAULT_DIV0_RESULT) || defined(FAULT_UNALIGNED_EMULATE)
+static void
+stats_validate(uint32_t *stats, uint32_t words)
+{
+    uint32_t i;
+
+    /* Retained RAM holds garbage after power-on. */
+    if (stats[0] != FAULT_STATS_MAGIC) {
+        for (i = 1u; i < words; i++) {
+            stats[i] = 0u;
+        }
+        stats[0] = FAULT_STATS_MAGIC;
+    }
+}
+#endif
+
+static int
+code_readable(uint32_t pc)
+{
+#ifdef FAULT_CODE_END
+    /* Fetch from a bad jump target would fault again, and lock up inside HardFault. Room for a 32-bit instruction. */
+    return (pc >= (uint32_t)(FAULT_CODE_START)) && (pc <= (uint32_t)(FAULT_CODE_END) - 4u);
+#else
+    (void)pc;
+    return 1;
+#endif
+}
+
+static void
+frame_set_reg(uint32_t *stack_frame, uint32_t *callee, uint32_t reg, uint32_t value)
+{
+    if ((reg >= 4u) && (reg <= 11u)) {
+        callee[reg - 4u] = value;
+    } else if (reg <= 3u) {
+        stack_frame[reg] = value;
+    } else if (reg == 12u) {
+        stack_frame[4] = value;
+    } else if (reg == 14u) {
+        stack_frame[5] = value;
+    }
+}
+
+#ifdef FAULT_DIV0_RESULT
+fault_div0_stats_t fault_div0_stats FAULT_RECORD_ATTR;
+#endif
+
+static int
+div0_recover(uint32_t *stack_frame, uint32_t *callee)
+{
+#ifdef FAULT_DIV0_RESULT
+#ifdef FAULT_MEASURE_CYCLES
+    uint32_t start = DWT_CYCCNT;
+    uint32_t cycles;
+#endif
+    uint32_t pc = stack_frame[6];
+    const uint16_t *instr = (const uint16_t *)(uintptr_t)pc;
+
+    if (((((uint32_t)instr[0] << 16) | instr[1]) & DIV_MASK) != DIV_VALUE) {
+        return 0;
+    }
+    frame_set_reg(stack_frame, callee, DIV_RD(instr[1]), (uint32_t)(FAULT_DIV0_RESULT));
+    advance_pc(stack_frame, 4u);
+    CFSR_CLEAR(1u << DIVBYZERO);
+
+    stats_validate((uint32_t *)&fault_div0_stats, sizeof(fault_div0_stats) / sizeof(uint32_t));
+    if (count_pc(fault_div0_stats.pc, fault_div0_stats.count, FAULT_DIV0_SLOTS, pc)) {
+        fault_div0_stats.dropped++;
+    }
+#ifdef FAULT_MEASURE_CYCLES
+    cycles = DWT_CYCCNT - start;
+    if (cycles > fault_div0_stats.cycles_max) {
+        fault_div0_stats.cycles_max = cycles;
+    }
+#endif
+    return 1;
+#else
+    (void)stack_frame;
+    (void)callee;
+    return 0;
+#endif
+}
+
+static void
+advance_pc(uint32_t *stack_frame, uint32_t size)
+{
+    uint32_t psr = stack_frame[7];
+    uint32_t it  = ((psr & PSR_IT_LO_MASK) >> 25) | ((psr & PSR_IT_HI_MASK) >> 8);
+
+    /* ITAdvance(): the block ends when IT[2:0] is zero, otherwise IT[4:0] shifts left. */
+    if (it != 0u) {
+        it = ((it & 0x7u) == 0u) ? 0u : ((it & 0xe0u) | ((it << 1) & 0x1fu));
+        psr &= ~(PSR_IT_LO_MASK | PSR_IT_HI_MASK);
+        psr |= ((it & 0x3u) << 25) | ((it & 0xfcu) << 8);
+        stack_frame[7] = psr;
+    }
+    stack_frame[6] += size;
+}
+
+#ifdef FAULT_EMULATE_SLOTS
+static int
+it_condition_passed(uint32_t psr)
+{
+    uint32_t it = ((psr & PSR_IT_LO_MASK) >> 25) | ((psr & PSR_IT_HI_MASK) >> 8);
+    uint32_t n  = (psr >> 31) & 1u;
+    uint32_t z  = (psr >> 30) & 1u;
+    uint32_t c  = (psr >> 29) & 1u;
+    uint32_t v  = (psr >> 28) & 1u;
+    uint32_t passed;
+
+    /* IT[3:0] is zero outside an IT block, IT[7:4] is the condition of the current instruction. */
+    if ((it & 0xfu) == 0u) {
+        return 1;
+    }
+    switch ((it >> 5) & 0x7u) {
+    case 0u: passed = z; break;                         /* EQ, NE */
+    case 1u: passed = c; break;                         /* CS, CC */
+    case 2u: passed = n; break;                         /* MI, PL */
+    case 3u: passed = v; break;                         /* VS, VC */
+    case 4u: passed = c & (z ^ 1u); break;              /* HI, LS */
+    case 5u: passed = (n == v); break;                  /* GE, LT */
+    case 6u: passed = (n == v) & (z ^ 1u); break;       /* GT, LE */
+    default: return 1;                                  /* AL */
+    }
+    /* Lowest condition bit selects the inverse. */
+    if (it & 0x10u) {
+        passed ^= 1u;
+    }
+    return (int)passed;
+}
+#endif
+
+static uint32_t
+frame_sp(const uint32_t *stack_frame, uint32_t exc)
+{
+    uint32_t frame_size = sizeof(fault_stack_frame_t);
+
+    /* Extended frame holds S0-S15, FPSCR and a reserved word. */
+    if ((exc != 0u) && !CHECK_BIT(exc, EXC_RETURN_FTYPE)) {
+        frame_size += FP_FRAME_SIZE;
+    }
+    /* Processor inserted a padding word to align the frame. */
+    if (CHECK_BIT(stack_frame[7], PSR_STKALIGN)) {
+        frame_size += sizeof(uint32_t);
+    }
+    return (uint32_t)(uintptr_t)stack_frame + frame_size;
+}
+
+#ifdef FAULT_EMULATE_SLOTS
+static fault_emu_entry_t *emulate_table[FAULT_EMULATE_SLOTS];
+static uint32_t emulate_count;
+
+int
+fault_emulate_register(fault_emu_entry_t *entry)
+{
+    if (emulate_count >= FAULT_EMULATE_SLOTS) {
+        return -1;
+    }
+    emulate_table[emulate_count] = entry;
+    emulate_count++;
+    return 0;
+}
+
+#endif
+
+uint32_t
+fault_emu_reg(const fault_emu_ctx_t *ctx, uint32_t reg)
+{
+    /* Position of R0-R3, R12 and LR in the stacked frame. */
+    static const uint8_t frame_index[16] = { 0u, 1u, 2u, 3u, 0u, 0u, 0u, 0u, 0u, 0u, 0u, 0u, 4u, 0u, 5u, 0u };
+
+    if ((reg >= 4u) && (reg <= 11u)) {
+        return ctx->callee[reg - 4u];
+    }
+    if (reg == 13u) {
+        return ctx->sp;
+    }
+    if (reg == 15u) {
+        return ctx->frame[6] + 4u;
+    }
+    return ctx->frame[frame_index[reg & 0xfu]];
+}
+
+void
+fault_emu_set_reg(fault_emu_ctx_t *ctx, uint32_t reg, uint32_t value)
+{
+    frame_set_reg(ctx->frame, ctx->callee, reg, value);
+}
+
+#ifdef FAULT_UNALIGNED_EMULATE
+fault_unaligned_stats_t fault_unaligned_stats FAULT_RECORD_ATTR;
+#endif
+
+static int
+unaligned_recover(uint32_t *stack_frame, uint32_t exc, uint32_t *callee)
+{
+#ifdef FAULT_UNALIGNED_EMULATE
+#ifdef FAULT_MEASURE_CYCLES
+    uint32_t start = DWT_CYCCNT;
+    uint32_t cycles;
+#endif
+    const uint16_t *pc = (const uint16_t *)(uintptr_t)stack_frame[6];
+    uint32_t hw1;
+    fault_emu_ctx_t ctx;
+    volatile uint8_t *data;
+    uint32_t address;
+    uint32_t value;
+    uint32_t rt;
+    uint32_t rn;
+    uint32_t bytes;
+    uint32_t size = 2u;
+    uint32_t writeback = 16u;   /* No writeback. */
+    uint32_t writeback_address = 0u;
+    int load;
+    int sign = 0;
+    uint32_t i;
+
+    if (!code_readable(stack_frame[6])) {
+        return 0;
+    }
+    hw1 = pc[0];
+    ctx.frame  = stack_frame;
+    ctx.callee = callee;
+    ctx.sp     = frame_sp(stack_frame, exc);
+
+    if (THUMB32(hw1)) {
+        uint32_t hw2 = pc[1];
+
+        size = 4u;
+        rn   = hw1 & 0xfu;
+        rt   = hw2 >> 12;
+        switch (hw1 & 0xfff0u) {
+        /* STR, LDR, STRH, LDRH, LDRSH with 12-bit immediate. */
+        case 0xf8c0u: load = 0; bytes = 4u; break;
+        case 0xf8d0u: load = 1; bytes = 4u; break;
+        case 0xf8a0u: load = 0; bytes = 2u; break;
+        case 0xf8b0u: load = 1; bytes = 2u; break;
+        case 0xf9b0u: load = 1; bytes = 2u; sign = 1; break;
+        /* Same with 8-bit immediate and P/U/W bits, or with shifted register. */
+        case 0xf840u: load = 0; bytes = 4u; break;
+        case 0xf850u: load = 1; bytes = 4u; break;
+        case 0xf820u: load = 0; bytes = 2u; break;
+        case 0xf830u: load = 1; bytes = 2u; break;
+        case 0xf930u: load = 1; bytes = 2u; sign = 1; break;
+        default:
+            return 0;
+        }
+        if (rn == 15u) {
+            return 0;
+        }
+        address = fault_emu_reg(&ctx, rn);
+        if (hw1 & 0x0080u) {
+            address += hw2 & 0xfffu;
+        } else if (hw2 & 0x0800u) {
+            uint32_t offset_address;
+
+            /* LDRT and STRT access with unprivileged rights, P = 0 with W = 0 is undefined. */
+            if (((hw2 & 0x0f00u) == 0x0e00u) || ((hw2 & 0x0500u) == 0u)) {
+                return 0;
+            }
+            offset_address = (hw2 & 0x0200u) ? (address + (hw2 & 0xffu)) : (address - (hw2 & 0xffu));
+
+            if (hw2 & 0x0400u) {
+                address = offset_address;
+            }
+            if (hw2 & 0x0100u) {
+                if (rn == 13u) {
+                    return 0;
+                }
+                writeback = rn;
+                writeback_address = offset_address;
+            }
+        } else if ((hw2 & 0x0fc0u) == 0u) {
+            address += fault_emu_reg(&ctx, hw2 & 0xfu) << ((hw2 >> 4) & 0x3u);
+        } else {
+            return 0;
+        }
+    } else {
+        rt = hw1 & 0x7u;
+        rn = (hw1 >> 3) & 0x7u;
+        address = fault_emu_reg(&ctx, rn);
+        switch (hw1 >> 11) {
+        /* STR, LDR, STRH, LDRH with 5-bit immediate. */
+        case 0x0cu: load = 0; bytes = 4u; address += ((hw1 >> 6) & 0x1fu) << 2; break;
+        case 0x0du: load = 1; bytes = 4u; address += ((hw1 >> 6) & 0x1fu) << 2; break;
+        case 0x10u: load = 0; bytes = 2u; address += ((hw1 >> 6) & 0x1fu) << 1; break;
+        case 0x11u: load = 1; bytes = 2u; address += ((hw1 >> 6) & 0x1fu) << 1; break;
+        /* Register offset, opcode in bits 11:9. */
+        case 0x0au:
+        case 0x0bu:
+            address += fault_emu_reg(&ctx, (hw1 >> 6) & 0x7u);
+            switch ((hw1 >> 9) & 0x7u) {
+            case 0u: load = 0; bytes = 4u; break;
+            case 1u: load = 0; bytes = 2u; break;
+            case 4u: load = 1; bytes = 4u; break;
+            case 5u: load = 1; bytes = 2u; break;
+            case 7u: load = 1; bytes = 2u; sign = 1; break;
+            default:
+                return 0;
+            }
+            break;
+        default:
+            return 0;
+        }
+    }
+    if (load && ((rt == 13u) || (rt == 15u))) {
+        return 0;
+    }
+    /* Aligned access faulted for another reason. */
+    if ((address & (bytes - 1u)) == 0u) {
+        return 0;
+    }
+
+    data = (volatile uint8_t *)(uintptr_t)address;
+    if (load) {
+        value = 0u;
+        for (i = 0u; i < bytes; i++) {
+            value |= (uint32_t)data[i] << (8u * i);
+        }
+        if (sign) {
+            value = (uint32_t)(int32_t)(int16_t)value;
+        }
+        fault_emu_set_reg(&ctx, rt, value);
+    } else {
+        value = fault_emu_reg(&ctx, rt);
+        for (i = 0u; i < bytes; i++) {
+            data[i] = (uint8_t)(value >> (8u * i));
+        }
+    }
+    if (writeback != 16u) {
+        fault_emu_set_reg(&ctx, writeback, writeback_address);
+    }
+    advance_pc(stack_frame, size);
+    CFSR_CLEAR(1u << UNALIGNED);
+
+    stats_validate((uint32_t *)&fault_unaligned_stats, sizeof(fault_unaligned_stats) / sizeof(uint32_t));
+    if (count_pc(fault_unaligned_stats.pc, fault_unaligned_stats.count, FAULT_UNALIGNED_SLOTS,
+                 (uint32_t)(uintptr_t)pc)) {
+        fault_unaligned_stats.dropped++;
+    }
+#ifdef FAULT_MEASURE_CYCLES
+    cycles = DWT_CYCCNT - start;
+    if (cycles > fault_unaligned_stats.cycles_max) {
+        fault_unaligned_stats.cycles_max = cycles;
+    }
+#endif
+    return 1;
+#else
+    (void)stack_frame;
+    (void)exc;
+    (void)callee;
+    return 0;
+#endif
+}
+
+static int
+emulate_recover(uint32_t *stack_frame, uint32_t exc, uint32_t *callee, uint32_t cause)
+{
+#ifdef FAULT_EMULATE_SLOTS
+#ifdef FAULT_MEASURE_CYCLES
+    uint32_t start = DWT_CYCCNT;
+    uint32_t cycles;
+#endif
+    const uint16_t *pc = (const uint16_t *)(uintptr_t)stack_frame[6];
+    fault_emu_ctx_t ctx;
+    fault_emu_entry_t *entry;
+    uint32_t instr = pc[0];
+    uint32_t size = 2u;
+    uint32_t i;
+
+    if (THUMB32(pc[0])) {
+        instr = (instr << 16) | pc[1];
+        size  = 4u;
+    }
+    for (i = 0u; i < emulate_count; i++) {
+        if ((instr & emulate_table[i]->mask) == emulate_table[i]->match) {
+            break;
+        }
+    }
+    if (i == emulate_count) {
+        return 0;
+    }
+
+    /* Trapping a skipped instruction of an IT block is IMPLEMENTATION DEFINED, it must not take effect. */
+    if (!it_condition_passed(stack_frame[7])) {
+        advance_pc(stack_frame, size);
+        CFSR_CLEAR(1u << cause);
+        return 1;
+    }
+
+    entry      = emulate_table[i];
+    ctx.frame  = stack_frame;
+    ctx.callee = callee;
+    ctx.sp     = frame_sp(stack_frame, exc);
+    if (!entry->handler(&ctx, instr)) {
+        return 0;
+    }
+    advance_pc(stack_frame, size);
+    CFSR_CLEAR(1u << cause);
+
+    entry->count++;
+#ifdef FAULT_MEASURE_CYCLES
+    cycles = DWT_CYCCNT - start;
+    entry->cycles_total += cycles;
+    if (cycles > entry->cycles_max) {
+        entry->cycles_max = cycles;
+    }
+#endif
+    return 1;
+#else
+    (void)stack_frame;
+    (void)exc;
+    (void)callee;
+    (void)cause;
+    return 0;
+#endif
+}
+
+#ifdef FAULT_LAZY_ZERO_REGION
+fault_lazy_zero_stats_t fault_lazy_zero_stats;
+
+static uint32_t lazy_zero_base;
+static uint32_t lazy_zero_size;     /* 0 - fault_lazy_zero_init() has not been called. */
+
+int
+fault_lazy_zero_init(void *base, uint32_t size_log2)
+{
+    uint32_t limit;
+
+    if ((size_log2 < 8u) || (size_log2 >= 32u)) {
+        return -1;
+    }
+    lazy_zero_base = (uint32_t)(uintptr_t)base;
+    lazy_zero_size = 1u << size_log2;
+
+#ifdef MPU_ARMV8M
+    /* No "no access" permission on ARMv8-M, but any access hitting two regions faults:
+     * the section is covered by FAULT_LAZY_ZERO_REGION and the next region, execution never. */
+    limit = ((lazy_zero_base + lazy_zero_size - 1u) & MPU_ADDR_MASK) | (1u << MPU_RLAR_EN);
+    MPU_RNR  = FAULT_LAZY_ZERO_REGION;
+    MPU_RBAR = (lazy_zero_base & MPU_ADDR_MASK) | (1u << MPU_RBAR_XN);
+    MPU_RASR = limit;
+    MPU_RNR  = FAULT_LAZY_ZERO_REGION + 1u;
+    MPU_RBAR = (lazy_zero_base & MPU_ADDR_MASK) | (1u << MPU_RBAR_XN);
+    MPU_RASR = limit;
+#else
+    /* No access for anyone, execution never. */
+    limit = (1u << MPU_RASR_XN) | ((size_log2 - 1u) << 1) | (1u << MPU_RASR_ENABLE);
+    MPU_RNR  = FAULT_LAZY_ZERO_REGION;
+    MPU_RBAR = lazy_zero_base & MPU_ADDR_MASK;
+    MPU_RASR = limit;
+#endif
+    __asm volatile("DSB; ISB" : : : "memory");
+    return 0;
+}
+#endif
+
+static int
+lazy_zero_recover(uint32_t address)
+{
+#ifdef FAULT_LAZY_ZERO_REGION
+#ifdef FAULT_MEASURE_CYCLES
+    uint32_t start = DWT_CYCCNT;
+    uint32_t cycles;
+#endif
+    uint32_t offset = address - lazy_zero_base;
+    volatile uint32_t *block = (volatile uint32_t *)(uintptr_t)lazy_zero_base;
+    uint32_t block_size;
+    uint32_t primask;
+    uint32_t rnr;
+    uint32_t rasr;
+    uint32_t i;
+
+    if ((lazy_zero_size == 0u) || (offset >= lazy_zero_size)) {
+        return 0;
+    }
+
+    /* The block has to be opened to be zeroed, nothing else may see it in between. */
+    __asm volatile("MRS %0, PRIMASK" : "=r" (primask));
+    __asm volatile("CPSID I" : : : "memory");
+
+    /* The fault may have interrupted code that is programming the MPU through RNR. */
+    rnr = MPU_RNR;
+    MPU_RNR = FAULT_LAZY_ZERO_REGION;
+    rasr = MPU_RASR;
+#ifdef MPU_ARMV8M
+    /* No subregions, the whole section is opened at once by disabling both regions. */
+    block_size = CHECK_BIT(rasr, MPU_RLAR_EN) ? lazy_zero_size : 0u;
+    rasr &= ~(1u << MPU_RLAR_EN);
+#else
+    /* Subregion i covers i-th eighth of the region, disabling it lets the background map through. */
+    block_size = lazy_zero_size >> 3;
+    i = offset / block_size;
+    if (CHECK_BIT(rasr, MPU_RASR_ENABLE) && !CHECK_BIT(MPU_RASR_SRD(rasr), i)) {
+        block += i * (block_size / 4u);
+        rasr |= 1u << (8u + i);
+        if (MPU_RASR_SRD(rasr) == 0xffu) {
+            rasr &= ~(1u << MPU_RASR_ENABLE);
+        }
+    } else {
+        /* Block is open already, the fault is not about zeroing. */
+        block_size = 0u;
+    }
+#endif
+    if (block_size != 0u) {
+        MPU_RASR = rasr;
+#ifdef MPU_ARMV8M
+        MPU_RNR  = FAULT_LAZY_ZERO_REGION + 1u;
+        MPU_RASR = rasr;
+#endif
+        __asm volatile("DSB; ISB" : : : "memory");
+        for (i = 0u; i < block_size / 4u; i++) {
+            block[i] = 0u;
+        }
+        CFSR_CLEAR(CFSR & CFSR_MMFSR_MASK);
+        __asm volatile("DSB" : : : "memory");
+    }
+    MPU_RNR = rnr;
+
+    __asm volatile("MSR PRIMASK, %0" : : "r" (primask) : "memory");
+    if (block_size == 0u) {
+        return 0;
+    }
+
+    fault_lazy_zero_stats.blocks++;
+#ifdef FAULT_MEASURE_CYCLES
+    cycles = DWT_CYCCNT - start;
+    if (cycles > fault_lazy_zero_stats.cycles_max) {
+        fault_lazy_zero_stats.cycles_max = cycles;
+    }
+#endif
+    return 1;
+#else
+    (void)address;
+    return 0;
+#endif
+}
+
+#ifdef FAULT_LAZY_FPU
+uint32_t fault_lazy_fpu_enables;
+
+void
+fault_lazy_fpu_switch(uint32_t fp_user)
+{
+    if (fp_user) {
+        CPACR |= CPACR_FPU_MASK;
+    } else {
+        CPACR &= ~CPACR_FPU_MASK;
+    }
+    __asm volatile("DSB; ISB" : : : "memory");
+}
+#endif
+
+static int
+lazy_fpu_recover(uint32_t exc)
+{
+#ifdef FAULT_LAZY_FPU
+    /* FPU is enabled already, so the coprocessor access is a real fault. */
+    if ((CPACR & CPACR_FPU_MASK) == CPACR_FPU_MASK) {
+        return 0;
+    }
+    CPACR |= CPACR_FPU_MASK;
+    __asm volatile("DSB; ISB" : : : "memory");
+    /* CP10 and CP11 are RAZ/WI without FPU, the instruction would fault again. */
+    if ((CPACR & CPACR_FPU_MASK) != CPACR_FPU_MASK) {
+        return 0;
+    }
+#ifdef FAULT_FPU_USER_MARK
+    /* Thread mode: the FP instruction is the task's. Handler mode: it is an interrupt handler's, not the task's. */
+    if (CHECK_BIT(exc, EXC_RETURN_MODE)) {
+        FAULT_FPU_USER_MARK()
+    }
+#else
+    (void)exc;
+#endif
+    CFSR_CLEAR(1u << NOCP);
+    fault_lazy_fpu_enables++;
+    return 1;
+#else
+    (void)exc;
+    return 0;
+#endif
+}
+
+static int
+is_privileged(uint32_t exc)
+{
+    uint32_t control;
+
+    /* Handler mode is always privileged, thread mode depends on CONTROL.nPRIV. */
+    __asm volatile("MRS %0, CONTROL" : "=r" (control));
+    return !CHECK_BIT(exc, EXC_RETURN_MODE) || !CHECK_BIT(control, CONTROL_NPRIV);
+}
+
+#ifdef FAULT_MPU_VIRT_FIRST
+fault_mpu_virt_stats_t fault_mpu_virt_stats;
+
+/* Logical region index + 1 loaded into each hardware slot, 0 - slot is free. */
+static uint32_t mpu_virt_loaded[MPU_VIRT_SLOTS];
+/* Load time of each slot, the least recently loaded slot is replaced. */
+static uint32_t mpu_virt_stamp[MPU_VIRT_SLOTS];
+static uint32_t mpu_virt_clock;
+
+void
+fault_mpu_virt_flush(void)
+{
+    uint32_t primask;
+    uint32_t rnr;
+    uint32_t i;
+
+    /* A MemManage fault in an interrupt would load a slot while they are being cleared. */
+    __asm volatile("MRS %0, PRIMASK" : "=r" (primask));
+    __asm volatile("CPSID I" : : : "memory");
+
+    rnr = MPU_RNR;
+    for (i = 0u; i < MPU_VIRT_SLOTS; i++) {
+        MPU_RNR  = FAULT_MPU_VIRT_FIRST + i;
+        MPU_RASR = 0u;
+        mpu_virt_loaded[i] = 0u;
+    }
+    MPU_RNR = rnr;
+    __asm volatile("DSB; ISB" : : : "memory");
+
+    __asm volatile("MSR PRIMASK, %0" : : "r" (primask) : "memory");
+}
+#endif
+
+static int
+mpu_virt_recover(uint32_t address, uint32_t exc)
+{
+#ifdef FAULT_MPU_VIRT_FIRST
+#ifdef FAULT_MEASURE_CYCLES
+    uint32_t start = DWT_CYCCNT;
+    uint32_t cycles;
+#endif
+#ifdef FAULT_CURRENT_TASK_ID
+    uint32_t task_id = (uint32_t)(FAULT_CURRENT_TASK_ID());
+    /* IDs above 31 have no bit in task_mask, such tasks get no region. */
+    uint32_t task_bit = (task_id < 32u) ? (1u << task_id) : 0u;
+#else
+    uint32_t task_bit = 1u;
+#endif
+    int privileged = is_privileged(exc);
+    uint32_t access;
+    uint32_t match;
+    uint32_t slot;
+    uint32_t primask;
+    uint32_t rnr;
+    uint32_t i;
+
+    for (match = 0u; match < fault_mpu_vregions_size; match++) {
+        const fault_mpu_vregion_t *region = &fault_mpu_vregions[match];
+
+        if ((region->task_mask & task_bit)
+                && mpu_region_match(region->rbar, region->rasr, address, privileged, &access)
+                && (access != 0u)) {
+            break;
+        }
+    }
+    if (match == fault_mpu_vregions_size) {
+        fault_mpu_virt_stats.denied++;
+        return 0;
+    }
+
+    /* Region is loaded already, so the access itself is not permitted. */
+    for (slot = 0u; slot < MPU_VIRT_SLOTS; slot++) {
+        if (mpu_virt_loaded[slot] == match + 1u) {
+            fault_mpu_virt_stats.denied++;
+            return 0;
+        }
+    }
+
+    /* Free slot, otherwise the least recently loaded one. */
+    slot = 0u;
+    for (i = 0u; i < MPU_VIRT_SLOTS; i++) {
+        if (mpu_virt_loaded[i] == 0u) {
+            slot = i;
+            break;
+        }
+        if ((int32_t)(mpu_virt_stamp[i] - mpu_virt_stamp[slot]) < 0) {
+            slot = i;
+        }
+    }
+
+    /* A preempting context switch must not see a half written region or slot table. */
+    __asm volatile("MRS %0, PRIMASK" : "=r" (primask));
+    __asm volatile("CPSID I" : : : "memory");
+    /* The fault may have interrupted code that is programming the MPU through RNR. */
+    rnr = MPU_RNR;
+    MPU_RNR  = FAULT_MPU_VIRT_FIRST + slot;
+    MPU_RBAR = fault_mpu_vregions[match].rbar;
+    MPU_RASR = fault_mpu_vregions[match].rasr;
+    MPU_RNR  = rnr;
+    mpu_virt_loaded[slot] = match + 1u;
+    mpu_virt_stamp[slot]  = ++mpu_virt_clock;
+    CFSR_CLEAR(CFSR & CFSR_MMFSR_MASK);
+    __asm volatile("DSB; ISB" : : : "memory");
+    __asm volatile("MSR PRIMASK, %0" : : "r" (primask) : "memory");
+
+    fault_mpu_virt_stats.swaps++;
+#ifdef FAULT_MEASURE_CYCLES
+    cycles = DWT_CYCCNT - start;
+    fault_mpu_virt_stats.cycles_total += cycles;
+    if (cycles > fault_mpu_virt_stats.cycles_max) {
+        fault_mpu_virt_stats.cycles_max = cycles;
+    }
+#endif
+    return 1;
+#else
+    (void)address;
+    (void)exc;
+    return 0;
+#endif
+}
+
+static const fault_policy_t *
+find_policy(uint32_t fault_class, uint32_t cfsr)
+{
+    uint32_t i;
+
+    for (i = 0u; i < sizeof(policy_table) / sizeof(policy_table[0]) - 1u; i++) {
+        if (((policy_table[i].fault_class == fault_class) || (policy_table[i].fault_class == FAULT_CLASS_ANY))
+                && ((policy_table[i].cfsr_mask == 0u) || (policy_table[i].cfsr_mask & cfsr))) {
+            break;
+        }
+    }
+    /* Last entry matches any class. */
+    return &policy_table[i];
+}
+
+static void
+report_decode(uint32_t handler_class)
+{
+    switch (handler_class) {
+    case FAULT_CLASS_HARD:
+        report_memmanage_fault();
+        report_bus_fault();
+        report_usage_fault();
+        report_hard_fault();
+        break;
+    case FAULT_CLASS_MEMMANAGE:
+        report_memmanage_fault();
+        break;
+    case FAULT_CLASS_BUS:
+        report_bus_fault();
+        break;
+    case FAULT_CLASS_USAGE:
+        report_usage_fault();
+        break;
+    case FAULT_CLASS_HANG:
+        FAULT_PRINTLN("Hang status:");
+        FAULT_PRINTLN(" - Watchdog early warning, PC points to the code that has stopped serving the watchdog.");
+        break;
+    default:
+        break;
+    }
+}
+
+static void
+handle_fault(const fault_policy_t *policy, uint32_t handler_class, uint32_t cfsr)
+{
+#ifdef FAULT_MEASURE_CYCLES
+    uint32_t start = DWT_CYCCNT;
+#endif
+
+    if (policy->sinks & FAULT_SINK_REPORT) {
+        if (handler_class == FAULT_CLASS_SOFTWARE) {
+            FAULT_PRINTLN("!!!Software fault detected!!!");
+        } else {
+            FAULT_PRINTLN("!!!Fault detected!!!");
+        }
+        report_record();
+    }
+    copy_pump(&fault_copies);
+
+    if (policy->sinks & FAULT_SINK_DECODE) {
+        report_decode(handler_class);
+    }
+
+    switch (handler_class) {
+#ifdef HARD_FAULT_HOOK
+    case FAULT_CLASS_HARD:
+        HARD_FAULT_HOOK()
+        break;
+#endif
+#ifdef MEMMANAGE_FAULT_HOOK
+    case FAULT_CLASS_MEMMANAGE:
+        MEMMANAGE_FAULT_HOOK()
+        break;
+#endif
+#ifdef BUS_FAULT_HOOK
+    case FAULT_CLASS_BUS:
+        BUS_FAULT_HOOK()
+        break;
+#endif
+#ifdef USAGE_FAULT_HOOK
+    case FAULT_CLASS_USAGE:
+        USAGE_FAULT_HOOK()
+        break;
+#endif
+#ifdef SOFT_FAULT_HOOK
+    case FAULT_CLASS_SOFTWARE:
+        SOFT_FAULT_HOOK()
+        break;
+#endif
+#ifdef HANG_HOOK
+    case FAULT_CLASS_HANG:
+        HANG_HOOK()
+        break;
+#endif
+    default:
+        break;
+    }
+
+    copy_join(&fault_copies);
+    if (policy->sinks & FAULT_SINK_REPORT) {
+        report_stack_window();
+    }
+
+    if (policy->sinks & FAULT_SINK_BINARY) {
+        write_record();
+    }
+
+#ifdef FAULT_UART_PIPELINED
+    uart_flush();
+#endif
+#ifdef FAULT_MEASURE_CYCLES
+    if (policy->depth != FAULT_DEPTH_NONE) {
+        fault_record.output_cycles = DWT_CYCCNT - start;
+    }
+#endif
+
+    if (policy->persist) {
+        persist_record();
+    }
+    set_handler_state(FAULT_HANDLER_DONE);
+
+    switch (policy->action) {
+    case FAULT_ACTION_REBOOT:
+        request_reset();
+        while(1);
+    case FAULT_ACTION_BREAKPOINT:
+        __asm volatile("BKPT #0");
+        while(1);
+    case FAULT_ACTION_STOP:
+        while(1);
+    case FAULT_ACTION_RETURN:
+        /* Status bits are sticky, they would show up in the next record and policy lookup. */
+        CFSR_CLEAR(cfsr);
+        break;
+    default:
+        halt_execution();
+        break;
+    }
+    set_handler_state(FAULT_HANDLER_IDLE);
+    fault_in_progress = 0u;
+}
+
+#ifdef FAULT_MEASURE_CYCLES
+uint32_t
+fault_report_benchmark(void)
+{
+    uint32_t start = DWT_CYCCNT;
+
+    report_record();
+    report_decode(fault_record.fault_class);
+    report_stack_window();
+#ifdef FAULT_UART_PIPELINED
+    uart_flush();
+#endif
+    return DWT_CYCCNT - start;
+}
+#endif
+
+#ifdef FAULT_SNAPSHOT_SLOTS
+/* Tag is passed on in R0 by the assembly. */
+__attribute__((naked)) void
+fault_snapshot_now(__attribute__((unused)) uint32_t tag)
+{
+    CAPTURE_CALLER_FRAME(capture_snapshot)
+}
+
+void
+capture_snapshot(uint32_t *stack_frame, uint32_t *callee)
+{
+    fault_record_t *record;
+    uint32_t primask;
+
+    __asm volatile("MRS %0, PRIMASK" : "=r" (primask));
+    __asm volatile("CPSID I" : : : "memory");
+
+    record = &fault_snapshots[fault_snapshot_next];
+    fault_snapshot_next = (fault_snapshot_next + 1u) % FAULT_SNAPSHOT_SLOTS;
+    capture_record(record, &snapshot_copies, stack_frame, callee, 0u, FAULT_CLASS_SNAPSHOT,
+                   FAULT_DEPTH_REGS | FAULT_DEPTH_STACK | FAULT_DEPTH_REGIONS);
+    copy_join(&snapshot_copies);
+    record->code = stack_frame[0];
+
+    __asm volatile("MSR PRIMASK, %0" : : "r" (primask) : "memory");
+}
+#endif
+
+static void
+capture_record(fault_record_t *record, copy_list_t *copies, uint32_t *stack_frame, uint32_t *callee,
+               uint32_t exc, uint32_t fault_class, uint32_t depth)
+{
+#ifdef FAULT_MEASURE_CYCLES
+    uint32_t start = DWT_CYCCNT;
+#endif
+#ifdef FAULT_IMAGE_SLOTS
+    uint32_t i;
+#endif
+    /* Without FAULT_DEPTH_REGS only PC, LR, xPSR, SP and fault status are kept, other registers are zero. */
+    uint32_t keep = (depth & FAULT_DEPTH_REGS) ? 0xffffffffu : 0u;
+
+    record->fault_class = fault_class;
+    record->frame.r0    = stack_frame[0] & keep;
+    record->frame.r1    = stack_frame[1] & keep;
+    record->frame.r2    = stack_frame[2] & keep;
+    record->frame.r3    = stack_frame[3] & keep;
+    record->frame.r12   = stack_frame[4] & keep;
+    record->frame.lr    = stack_frame[5];
+    record->frame.pc    = stack_frame[6];
+    record->frame.psr   = stack_frame[7];
+    record->callee.r4   = callee[0] & keep;
+    record->callee.r5   = callee[1] & keep;
+    record->callee.r6   = callee[2] & keep;
+    record->callee.r7   = callee[3] & keep;
+    record->callee.r8   = callee[4] & keep;
+    record->callee.r9   = callee[5] & keep;
+    record->callee.r10  = callee[6] & keep;
+    record->callee.r11  = callee[7] & keep;
+    record->exc_return  = exc;
+    record->hfsr        = HFSR;
+    record->cfsr        = CFSR;
+    record->mmfar       = MMFAR;
+    record->bfar        = BFAR;
+    record->afsr        = AFSR;
+    record->code        = 0u;
+    record->file_id     = 0u;
+    record->line        = 0u;
+#ifdef FAULT_CURRENT_TASK
+    record->task        = (uint32_t)(FAULT_CURRENT_TASK());
+#endif
+    record->sp          = frame_sp(stack_frame, exc);
+#ifdef FAULT_CAPTURE_FP
+    record->fp_flags    = 0u;
+    if (depth & FAULT_DEPTH_REGS) {
+        capture_fp(record, stack_frame, exc);
+    }
+#endif
+#ifdef FAULT_IMAGE_SLOTS
+    for (i = 0u; i < image_count; i++) {
+        record->image[i] = images[i];
+    }
+    record->image_count = image_count;
+#endif
+
+#ifdef ARMV6M
+    /* No fault status, any HardFault may be a failed check. */
+    if (fault_class == FAULT_CLASS_HARD) {
+        capture_check_trap(record);
+    }
+#else
+    if (CHECK_BIT(record->cfsr, UNDEFINSTR)
+            && ((fault_class == FAULT_CLASS_USAGE) || (fault_class == FAULT_CLASS_HARD))) {
+        capture_check_trap(record);
+    }
+#endif
+    copies->count = 0u;
+#ifdef FAULT_STACK_WINDOW_WORDS
+    record->stack_words = 0u;
+    if (depth & FAULT_DEPTH_STACK) {
+        capture_stack_window(record, copies);
+    }
+#endif
+#ifdef FAULT_CAPTURE_REGIONS
+    record->region_count = 0u;
+    if (depth & FAULT_DEPTH_REGIONS) {
+        capture_regions_queue(record, copies);
+    }
+#endif
+    /* With DMA the copies run while the CPU captures the rest and prints the report. */
+    copy_start(copies);
+#ifdef FAULT_PERIPH_BUDGET
+    record->periph_bytes = 0u;
+    if (depth & FAULT_DEPTH_PERIPH) {
+        capture_periph(record);
+    }
+#endif
+#ifdef FAULT_CAPTURE_MPU
+    record->mpu_regions = 0u;
+    if ((depth & FAULT_DEPTH_MPU) && CHECK_BIT(record->cfsr, MMARVALID)) {
+        capture_mpu(record);
+    }
+#endif
+#ifdef FAULT_MEASURE_CYCLES
+    record->capture_cycles = DWT_CYCCNT - start;
+    record->output_cycles  = 0u;
+#endif
+    record->magic = FAULT_RECORD_MAGIC;
+}
+
+#ifdef FAULT_CAPTURE_FP
+static void
+capture_fp(fault_record_t *record, const uint32_t *stack_frame, uint32_t exc)
+{
+    uint32_t fpccr = FPCCR;
+#ifdef __ARM_FP
+    uint32_t cpacr;
+#endif
+    uint32_t i;
+
+    record->fp_flags = 0u;
+    record->fpccr    = fpccr;
+    record->fpcar    = FPCAR;
+    if (CHECK_BIT(record->cfsr, MLSPERR) || CHECK_BIT(record->cfsr, LSPERR)) {
+        record->fp_flags |= FAULT_FP_LAZY_ERROR;
+    }
+
+    if (CHECK_BIT(fpccr, FPCCR_LSPACT)) {
+        /* Space at FPCAR has not been written, S0-S15 still hold the values. Any FP instruction
+         * retries the preservation, so LSPACT is cleared while they are read and set back after. */
+        record->fp_flags |= FAULT_FP_PENDING;
+#ifdef __ARM_FP
+        /* FPU may be disabled (FAULT_LAZY_FPU), then the reads would raise NOCP inside the handler. */
+        cpacr = CPACR;
+        CPACR = cpacr | CPACR_FPU_MASK;
+        FPCCR = fpccr & ~(1u << FPCCR_LSPACT);
+        __asm volatile("DSB; ISB" : : : "memory");
+        __asm volatile("VSTMIA %0, {S0-S15}" : : "r" (record->fp_regs) : "memory");
+        __asm volatile("VMRS %0, FPSCR" : "=r" (record->fpscr));
+        FPCCR = fpccr;
+        CPACR = cpacr;
+        __asm volatile("DSB; ISB" : : : "memory");
+        record->fp_flags |= FAULT_FP_CAPTURED;
+#endif
+    } else if ((exc != 0u) && !CHECK_BIT(exc, EXC_RETURN_FTYPE)
+            && !CHECK_BIT(record->cfsr, MSTKERR) && !CHECK_BIT(record->cfsr, STKERR)) {
+        /* Extended frame: S0-S15 and FPSCR follow the basic frame. */
+        for (i = 0u; i < 16u; i++) {
+            record->fp_regs[i] = stack_frame[8u + i];
+        }
+        record->fpscr = stack_frame[24];
+        record->fp_flags |= FAULT_FP_CAPTURED;
+    }
+}
+#endif
+
+static void
+capture_check_trap(fault_record_t *record)
+{
+    const uint16_t *instr = (const uint16_t *)(uintptr_t)record->frame.pc;
+    uint32_t id;
+
+    if (!code_readable(record->frame.pc)) {
+        return;
+    }
+    if ((instr[0] & UDF_T1_MASK) == UDF_T1_VALUE) {
+        id = instr[0] & ~UDF_T1_MASK;
+    } else if (((instr[0] & UDF_T2_MASK_HI) == UDF_T2_VALUE_HI)
+            && ((instr[1] & UDF_T2_MASK_LO) == UDF_T2_VALUE_LO)) {
+        id = ((instr[0] & ~UDF_T2_MASK_HI) << 12) | (instr[1] & ~UDF_T2_MASK_LO);
+    } else {
+        return;
+    }
+
+    record->fault_class = FAULT_CLASS_SOFTWARE;
+    record->code        = FAULT_SOFT_CHECK;
+    record->line        = id;
+}
+
+static void
+capture_mpu(fault_record_t *record)
+{
+#ifdef FAULT_CAPTURE_MPU
+    uint32_t regions = MPU_TYPE_DREGION(MPU_TYPE);
+    uint32_t i;
+
+    if (regions > FAULT_MPU_MAX_REGIONS) {
+        regions = FAULT_MPU_MAX_REGIONS;
+    }
+    __asm volatile("MRS %0, CONTROL" : "=r" (record->control));
+    record->mpu_ctrl = MPU_CTRL;
+    for (i = 0u; i < regions; i++) {
+        MPU_RNR = i;
+        record->mpu_rbar[i] = MPU_RBAR;
+        record->mpu_rasr[i] = MPU_RASR;
+    }
+    record->mpu_regions = regions;
+#else
+    (void)record;
+#endif
+}
+
+static void
+capture_periph(fault_record_t *record)
+{
+#ifdef FAULT_PERIPH_BUDGET
+    uint32_t used = 0u;
+    uint32_t d;
+    uint32_t i;
+
+    for (d = 0u; d < fault_periph_table_size; d++) {
+        const fault_periph_desc_t *desc = &fault_periph_table[d];
+        uint32_t value;
+
+        if (used + (uint32_t)desc->width * desc->count > FAULT_PERIPH_BUDGET) {
+            break;
+        }
+        for (i = 0u; i < desc->count; i++) {
+            uint32_t address = desc->address + i * desc->width;
+
+            value = 0u;
+#ifndef FAULT_PERIPH_READ_SIDE_EFFECTS
+            if (!(desc->flags & FAULT_PERIPH_SIDE_EFFECTS))
+#endif
+            {
+                switch (desc->width) {
+                case 1u:
+                    value = *(volatile uint8_t *)(uintptr_t)address;
+                    break;
+                case 2u:
+                    value = *(volatile uint16_t *)(uintptr_t)address;
+                    break;
+                default:
+                    value = *(volatile uint32_t *)(uintptr_t)address;
+                    break;
+                }
+            }
+            /* Little endian, same as the target. */
+            record->periph[used++] = (uint8_t)value;
+            if (desc->width > 1u) {
+                record->periph[used++] = (uint8_t)(value >> 8);
+            }
+            if (desc->width > 2u) {
+                record->periph[used++] = (uint8_t)(value >> 16);
+                record->periph[used++] = (uint8_t)(value >> 24);
+            }
+        }
+    }
+    record->periph_bytes = used;
+#else
+    (void)record;
+#endif
+}
+
+static uint32_t
+stack_window_words(const fault_record_t *record)
+{
+#ifdef FAULT_STACK_WINDOW_WORDS
+    uint32_t words = FAULT_STACK_WINDOW_WORDS;
+
+    /* Stack pointer can not be trusted if stacking itself has failed. */
+    if (CHECK_BIT(record->cfsr, MSTKERR) || CHECK_BIT(record->cfsr, STKERR)) {
+        return 0u;
+    }
+#ifdef FAULT_STACK_END
+    if (record->sp >= (uint32_t)(FAULT_STACK_END)) {
+        words = 0u;
+    } else if (words > ((uint32_t)(FAULT_STACK_END) - record->sp) / sizeof(uint32_t)) {
+        words = ((uint32_t)(FAULT_STACK_END) - record->sp) / sizeof(uint32_t);
+    }
+#endif
+    return words;
+#else
+    (void)record;
+    return 0u;
+#endif
+}
+
+static void
+capture_stack_window(fault_record_t *record, copy_list_t *copies)
+{
+#ifdef FAULT_STACK_WINDOW_WORDS
+    uint32_t words = stack_window_words(record);
+
+    copy_queue(copies, record->stack, (const void *)(uintptr_t)record->sp, words * sizeof(uint32_t));
+    record->stack_words = words;
+#else
+    (void)record;
+    (void)copies;
+#endif
+}
+
+static void
+capture_regions_queue(fault_record_t *record, copy_list_t *copies)
+{
+#ifdef FAULT_CAPTURE_REGIONS
+    uint32_t used = 0u;
+    uint32_t i;
+
+    for (i = 0u; i < capture_region_count; i++) {
+        uint32_t len = capture_regions[i].len;
+
+        if (len > FAULT_CAPTURE_REGION_BYTES - used) {
+            len = FAULT_CAPTURE_REGION_BYTES - used;
+        }
+        copy_queue(copies, &record->region_data[used], (const void *)(uintptr_t)capture_regions[i].address, len);
+        record->region[i].address = capture_regions[i].address;
+        record->region[i].len     = len;
+        used += len;
+    }
+    record->region_count = capture_region_count;
+#else
+    (void)record;
+    (void)copies;
+#endif
+}
+
+#ifdef FAULT_CAPTURE_REGIONS
+int
+fault_capture_region(const void *base, uint32_t len)
+{
+    if (capture_region_count >= FAULT_CAPTURE_REGIONS) {
+        return -1;
+    }
+    capture_regions[capture_region_count].address = (uint32_t)(uintptr_t)base;
+    capture_regions[capture_region_count].len     = len;
+    capture_region_count++;
+    return 0;
+}
+#endif
+
+#ifdef FAULT_IMAGE_SLOTS
+int
+fault_register_image(const void *build_id, uint32_t id_len, uint32_t load_address, uint32_t size)
+{
+    const uint8_t *id = build_id;
+    fault_image_t *image;
+    uint32_t i;
+
+    if (image_count >= FAULT_IMAGE_SLOTS) {
+        return -1;
+    }
+    image = &images[image_count];
+    for (i = 0u; i < FAULT_IMAGE_ID_BYTES; i++) {
+        image->build_id[i] = (i < id_len) ? id[i] : 0u;
+    }
+    image->load_address = load_address;
+    image->size         = size;
+    image_count++;
+    return 0;
+}
+#endif
+
+#ifdef FAULT_DMA_SIM
+static uint8_t *dma_sim_dst;
+static const uint8_t *dma_sim_src;
+static uint32_t dma_sim_left;
+
+static void
+dma_sim_start(void *dst, const void *src, uint32_t len)
+{
+    dma_sim_dst  = dst;
+    dma_sim_src  = src;
+    dma_sim_left = len;
+}
+
+static int
+dma_sim_busy(void)
+{
+    uint32_t chunk = (dma_sim_left < FAULT_DMA_SIM_CHUNK) ? dma_sim_left : FAULT_DMA_SIM_CHUNK;
+
+    dma_sim_left -= chunk;
+    while (chunk--) {
+        *dma_sim_dst++ = *dma_sim_src++;
+    }
+    return dma_sim_left != 0u;
+}
+#endif
+
+static void
+copy_queue(copy_list_t *copies, void *dst, const void *src, uint32_t len)
+{
+    if ((len != 0u) && (copies->count < COPY_JOBS)) {
+        copies->job[copies->count].dst = dst;
+        copies->job[copies->count].src = src;
+        copies->job[copies->count].len = len;
+        copies->count++;
+    }
+}
+
+static void
+copy_start(copy_list_t *copies)
+{
+    copies->next = 0u;
+#ifdef FAULT_DMA_START
+    copy_pump(copies);
+#else
+    for (; copies->next < copies->count; copies->next++) {
+        const copy_job_t *job = &copies->job[copies->next];
+        uint32_t i;
+
+        if ((((uintptr_t)job->dst | (uintptr_t)job->src | job->len) & 3u) == 0u) {
+            for (i = 0u; i < job->len / sizeof(uint32_t); i++) {
+                ((uint32_t *)job->dst)[i] = ((const uint32_t *)job->src)[i];
+            }
+        } else {
+            for (i = 0u; i < job->len; i++) {
+                ((uint8_t *)job->dst)[i] = ((const uint8_t *)job->src)[i];
+            }
+        }
+    }
+#endif
+}
+
+static void
+copy_pump(copy_list_t *copies)
+{
+#ifdef FAULT_DMA_START
+    /* Channel is shared: a fault may arrive while a snapshot copy is running. */
+    if ((copies->next < copies->count) && !FAULT_DMA_BUSY()) {
+        FAULT_DMA_START(copies->job[copies->next].dst, copies->job[copies->next].src,
+                        copies->job[copies->next].len);
+        copies->next++;
+    }
+#else
+    (void)copies;
+#endif
+}
+
+static void
+copy_join(copy_list_t *copies)
+{
+#ifdef FAULT_DMA_START
+    while (copies->next < copies->count) {
+        copy_pump(copies);
+    }
+    while (FAULT_DMA_BUSY());
+#else
+    (void)copies;
+#endif
+}
+
+static void
+write_record(void)
+{
+#if defined(FAULT_SINK_WRITEV) && defined(FAULT_RECORD_TLV)
+    static tlv_builder_t builder;
+
+    tlv_build(&builder, &fault_record);
+    FAULT_SINK_WRITEV(builder.iov, builder.segments);
+#elif defined(FAULT_SINK_WRITEV)
+    /* Static like the TLV builder, an asynchronous sink reads the segments after FAULT_SINK_WRITEV returns. */
+    static fault_stream_header_t header;
+    static fault_iovec_t iov[3];
+    uint32_t record_size = sizeof(fault_record);
+
+#ifdef FAULT_STACK_WINDOW_WORDS
+    /* Stack window goes straight from the stack, the copy in the record is not needed. */
+    record_size = offsetof(fault_record_t, stack);
+#endif
+    iov[1].base = &fault_record;
+    iov[1].len  = record_size;
+    iov[2].base = (const void *)(uintptr_t)fault_record.sp;
+    iov[2].len  = stack_window_words(&fault_record) * sizeof(uint32_t);
+
+    header.magic       = FAULT_STREAM_MAGIC;
+    header.record_size = (uint16_t)iov[1].len;
+    header.stack_size  = (uint16_t)iov[2].len;
+    iov[0].base = &header;
+    iov[0].len  = sizeof(header);
+
+    FAULT_SINK_WRITEV(iov, 3u);
+#endif
+}
+
+#ifdef FAULT_RECORD_TLV
+/* Zero padding of section values. */
+static const uint8_t tlv_padding[3];
+
+/**
+ * @brief  Add a segment, counted into the open section if there is one
+ */
+static void
+tlv_add(tlv_builder_t *builder, const void *base, uint32_t len)
+{
+    if (len == 0u) {
+        return;
+    }
+    builder->iov[builder->segments].base = base;
+    builder->iov[builder->segments].len  = len;
+    builder->segments++;
+    builder->header.total_size += len;
+}
+
+/**
+ * @brief  Open a section, its value is added with tlv_value()
+ */
+static void
+tlv_begin(tlv_builder_t *builder, uint32_t type)
+{
+    fault_tlv_t *tag = &builder->tag[builder->sections];
+
+    builder->sections++;
+    tag->type = (uint16_t)type;
+    tag->len  = 0u;
+    tlv_add(builder, tag, sizeof(*tag));
+}
+
+/**
+ * @brief  Add part of the value of the open section
+ */
+static void
+tlv_value(tlv_builder_t *builder, const void *base, uint32_t len)
+{
+    builder->tag[builder->sections - 1u].len += (uint16_t)len;
+    tlv_add(builder, base, len);
+}
+
+/**
+ * @brief  Close the open section, pad it to a multiple of 4 bytes
+ */
+static void
+tlv_end(tlv_builder_t *builder)
+{
+    uint32_t len = builder->tag[builder->sections - 1u].len;
+
+    tlv_add(builder, tlv_padding, (4u - (len & 3u)) & 3u);
+}
+
+static void
+tlv_build(tlv_builder_t *builder, const fault_record_t *record)
+{
+    builder->sections = 0u;
+    builder->segments = 0u;
+    builder->header.magic       = FAULT_TLV_MAGIC;
+    builder->header.version     = FAULT_TLV_VERSION;
+    builder->header.header_size = sizeof(fault_tlv_header_t);
+    builder->header.total_size  = 0u;
+    builder->header.fault_class = record->fault_class;
+    builder->header.pc          = record->frame.pc;
+    builder->header.lr          = record->frame.lr;
+    builder->header.cfsr        = record->cfsr;
+    builder->header.code        = record->code;
+    tlv_add(builder, &builder->header, sizeof(builder->header));
+
+    tlv_begin(builder, FAULT_TLV_REGS);
+    tlv_value(builder, &record->frame,
+              offsetof(fault_record_t, exc_return) + sizeof(uint32_t) - offsetof(fault_record_t, frame));
+    tlv_end(builder);
+    tlv_begin(builder, FAULT_TLV_STATUS);
+    tlv_value(builder, &record->hfsr,
+              offsetof(fault_record_t, afsr) + sizeof(uint32_t) - offsetof(fault_record_t, hfsr));
+    tlv_end(builder);
+    if (record->fault_class == FAULT_CLASS_SOFTWARE) {
+        tlv_begin(builder, FAULT_TLV_SOFT);
+        tlv_value(builder, &record->code,
+                  offsetof(fault_record_t, line) + sizeof(uint32_t) - offsetof(fault_record_t, code));
+        tlv_end(builder);
+    }
+#ifdef FAULT_CURRENT_TASK
+    tlv_begin(builder, FAULT_TLV_TASK);
+    tlv_value(builder, &record->task, sizeof(record->task));
+    tlv_end(builder);
+#endif
+#ifdef FAULT_MEASURE_CYCLES
+    tlv_begin(builder, FAULT_TLV_CYCLES);
+    tlv_value(builder, &record->capture_cycles,
+              offsetof(fault_record_t, output_cycles) + sizeof(uint32_t) - offsetof(fault_record_t, capture_cycles));
+    tlv_end(builder);
+#endif
+#ifdef FAULT_CAPTURE_MPU
+    if (record->mpu_regions != 0u) {
+        tlv_begin(builder, FAULT_TLV_MPU);
+        tlv_value(builder, &record->control, 3u * sizeof(uint32_t));
+        tlv_value(builder, record->mpu_rbar, record->mpu_regions * sizeof(uint32_t));
+        tlv_value(builder, record->mpu_rasr, record->mpu_regions * sizeof(uint32_t));
+        tlv_end(builder);
+    }
+#endif
+#ifdef FAULT_PERIPH_BUDGET
+    if (record->periph_bytes != 0u) {
+        tlv_begin(builder, FAULT_TLV_PERIPH);
+        tlv_value(builder, record->periph, record->periph_bytes);
+        tlv_end(builder);
+    }
+#endif
+#ifdef FAULT_CAPTURE_REGIONS
+    if (record->region_count != 0u) {
+        uint32_t used = 0u;
+        uint32_t i;
+
+        for (i = 0u; i < record->region_count; i++) {
+            used += record->region[i].len;
+        }
+        tlv_begin(builder, FAULT_TLV_REGIONS);
+        tlv_value(builder, &record->region_count, sizeof(record->region_count));
+        tlv_value(builder, record->region, record->region_count * sizeof(fault_region_t));
+        tlv_value(builder, record->region_data, used);
+        tlv_end(builder);
+    }
+#endif
+#ifdef FAULT_CAPTURE_FP
+    if (record->fp_flags != 0u) {
+        tlv_begin(builder, FAULT_TLV_FP);
+        tlv_value(builder, &record->fp_flags,
+                  offsetof(fault_record_t, fpscr) + sizeof(uint32_t) - offsetof(fault_record_t, fp_flags));
+        tlv_end(builder);
+    }
+#endif
+#ifdef FAULT_IMAGE_SLOTS
+    if (record->image_count != 0u) {
+        tlv_begin(builder, FAULT_TLV_IMAGES);
+        tlv_value(builder, &record->image_count, sizeof(record->image_count));
+        tlv_value(builder, record->image, record->image_count * sizeof(fault_image_t));
+        tlv_end(builder);
+    }
+#endif
+#ifdef FAULT_STACK_WINDOW_WORDS
+    if (record->stack_words != 0u) {
+        tlv_begin(builder, FAULT_TLV_STACK);
+        tlv_value(builder, record->stack, record->stack_words * sizeof(uint32_t));
+        tlv_end(builder);
+    }
+#endif
+}
+
+uint32_t
+fault_record_encode(const fault_record_t *record, void *buf, uint32_t size)
+{
+    static tlv_builder_t builder;
+    uint8_t *out = buf;
+    uint32_t i;
+    uint32_t j;
+
+    tlv_build(&builder, record);
+    if (builder.header.total_size > size) {
+        return 0u;
+    }
+    for (i = 0u; i < builder.segments; i++) {
+        const uint8_t *src = builder.iov[i].base;
+
+        for (j = 0u; j < builder.iov[i].len; j++) {
+            *out++ = src[j];
+        }
+    }
+    return builder.header.total_size;
+}
+#endif
+
+static void
+report_record(void)
+{
+    FAULT_PRINTLN("Stack frame:");
+    FAULT_PRINT("R0 :    "); FAULT_PRINT_HEX(fault_record.frame.r0); FAULT_NEWLINE();
+    FAULT_PRINT("R1 :    "); FAULT_PRINT_HEX(fault_record.frame.r1); FAULT_NEWLINE();
+    FAULT_PRINT("R2 :    "); FAULT_PRINT_HEX(fault_record.frame.r2); FAULT_NEWLINE();
+    FAULT_PRINT("R3 :    "); FAULT_PRINT_HEX(fault_record.frame.r3); FAULT_NEWLINE();
+    FAULT_PRINT("R12:    "); FAULT_PRINT_HEX(fault_record.frame.r12); FAULT_NEWLINE();
+    FAULT_PRINT("LR :    "); FAULT_PRINT_HEX(fault_record.frame.lr); FAULT_NEWLINE();
+    FAULT_PRINT("PC :    "); FAULT_PRINT_HEX(fault_record.frame.pc); FAULT_NEWLINE();
+    FAULT_PRINT("PSR:    "); FAULT_PRINT_HEX(fault_record.frame.psr); FAULT_NEWLINE();
+    FAULT_PRINT("SP :    "); FAULT_PRINT_HEX(fault_record.sp); FAULT_NEWLINE();
+    FAULT_PRINT("R4 :    "); FAULT_PRINT_HEX(fault_record.callee.r4); FAULT_NEWLINE();
+    FAULT_PRINT("R5 :    "); FAULT_PRINT_HEX(fault_record.callee.r5); FAULT_NEWLINE();
+    FAULT_PRINT("R6 :    "); FAULT_PRINT_HEX(fault_record.callee.r6); FAULT_NEWLINE();
+    FAULT_PRINT("R7 :    "); FAULT_PRINT_HEX(fault_record.callee.r7); FAULT_NEWLINE();
+    FAULT_PRINT("R8 :    "); FAULT_PRINT_HEX(fault_record.callee.r8); FAULT_NEWLINE();
+    FAULT_PRINT("R9 :    "); FAULT_PRINT_HEX(fault_record.callee.r9); FAULT_NEWLINE();
+    FAULT_PRINT("R10:    "); FAULT_PRINT_HEX(fault_record.callee.r10); FAULT_NEWLINE();
+    FAULT_PRINT("R11:    "); FAULT_PRINT_HEX(fault_record.callee.r11); FAULT_NEWLINE();
+
+    FAULT_PRINTLN("Fault status:");
+    FAULT_PRINT("HFSR:    "); FAULT_PRINT_HEX(fault_record.hfsr); FAULT_NEWLINE();
+    FAULT_PRINT("CFSR:    "); FAULT_PRINT_HEX(fault_record.cfsr); FAULT_NEWLINE();
+    FAULT_PRINT("MMAR:    "); FAULT_PRINT_HEX(fault_record.mmfar); FAULT_NEWLINE();
+    FAULT_PRINT("BFAR:    "); FAULT_PRINT_HEX(fault_record.bfar); FAULT_NEWLINE();
+    FAULT_PRINT("AFSR:    "); FAULT_PRINT_HEX(fault_record.afsr); FAULT_NEWLINE();
+
+    FAULT_PRINTLN("Other:");
+    FAULT_PRINT("EXC_RETURN: "); FAULT_PRINT_HEX(fault_record.exc_return); FAULT_NEWLINE();
+#ifdef FAULT_CURRENT_TASK
+    FAULT_PRINT("Task:       "); FAULT_PRINT_HEX(fault_record.task); FAULT_NEWLINE();
+#endif
+
+#ifdef FAULT_IMAGE_SLOTS
+    if (fault_record.image_count != 0u) {
+        uint32_t i;
+
+        FAULT_PRINTLN("Images (load address, size, build ID):");
+        for (i = 0u; i < fault_record.image_count; i++) {
+            const uint8_t *id = fault_record.image[i].build_id;
+
+            FAULT_PRINT("  "); FAULT_PRINT_HEX(fault_record.image[i].load_address);
+            FAULT_PRINT(" "); FAULT_PRINT_HEX(fault_record.image[i].size);
+            FAULT_PRINT(" "); FAULT_PRINT_HEX(((uint32_t)id[0] << 24) | ((uint32_t)id[1] << 16)
+                                              | ((uint32_t)id[2] << 8) | id[3]);
+            FAULT_NEWLINE();
+        }
+    }
+#endif
+
+#ifdef FAULT_CAPTURE_FP
+    if (fault_record.fp_flags != 0u) {
+        static const char *const names[16] = {
+            "S0 :    ", "S1 :    ", "S2 :    ", "S3 :    ", "S4 :    ", "S5 :    ", "S6 :    ", "S7 :    ",
+            "S8 :    ", "S9 :    ", "S10:    ", "S11:    ", "S12:    ", "S13:    ", "S14:    ", "S15:    "
+        };
+        uint32_t i;
+
+        FAULT_PRINTLN("FP state:");
+        FAULT_PRINT("FPCCR:   "); FAULT_PRINT_HEX(fault_record.fpccr); FAULT_NEWLINE();
+        FAULT_PRINT("FPCAR:   "); FAULT_PRINT_HEX(fault_record.fpcar); FAULT_NEWLINE();
+        if (fault_record.fp_flags & FAULT_FP_LAZY_ERROR) {
+            FAULT_PRINTLN(" - Fault during lazy FP preservation of the frame at FPCAR.");
+        }
+        if (fault_record.fp_flags & FAULT_FP_PENDING) {
+            FAULT_PRINTLN(" - FP state was still in registers, not in the stack frame.");
+        }
+        if (fault_record.fp_flags & FAULT_FP_CAPTURED) {
+            for (i = 0u; i < 16u; i++) {
+                FAULT_PRINT(names[i]); FAULT_PRINT_HEX(fault_record.fp_regs[i]); FAULT_NEWLINE();
+            }
+            FAULT_PRINT("FPSCR:   "); FAULT_PRINT_HEX(fault_record.fpscr); FAULT_NEWLINE();
+        }
+    }
+#endif
+
+    if (fault_record.fault_class == FAULT_CLASS_SOFTWARE) {
+        FAULT_PRINTLN("Software fault:");
+        FAULT_PRINT("Code:    "); FAULT_PRINT_HEX(fault_record.code); FAULT_NEWLINE();
+        FAULT_PRINT("File:    "); FAULT_PRINT_HEX(fault_record.file_id); FAULT_NEWLINE();
+        FAULT_PRINT("Line:    "); FAULT_PRINT_HEX(fault_record.line); FAULT_NEWLINE();
+    }
+
+#ifdef FAULT_PERIPH_BUDGET
+    if (fault_record.periph_bytes != 0u) {
+        uint32_t used = 0u;
+        uint32_t d;
+        uint32_t i;
+
+        FAULT_PRINTLN("Peripherals:");
+        for (d = 0u; d < fault_periph_table_size; d++) {
+            const fault_periph_desc_t *desc = &fault_periph_table[d];
+
+            for (i = 0u; (i < desc->count) && (used + desc->width <= fault_record.periph_bytes); i++) {
+                uint32_t value = fault_record.periph[used];
+
+                if (desc->width > 1u) {
+                    value |= (uint32_t)fault_record.periph[used + 1u] << 8;
+                }
+                if (desc->width > 2u) {
+                    value |= (uint32_t)fault_record.periph[used + 2u] << 16;
+                    value |= (uint32_t)fault_record.periph[used + 3u] << 24;
+                }
+                used += desc->width;
+                FAULT_PRINT("  "); FAULT_PRINT_HEX(desc->address + i * desc->width);
+                FAULT_PRINT(": "); FAULT_PRINT_HEX(value); FAULT_NEWLINE();
+            }
+        }
+    }
+#endif
+}
+
+static void
+report_stack_window(void)
+{
+#ifdef FAULT_STACK_WINDOW_WORDS
+    uint32_t i;
+
+    if (fault_record.stack_words != 0u) {
+        FAULT_PRINTLN("Stack:");
+    }
+    for (i = 0u; i < fault_record.stack_words; i++) {
+        FAULT_PRINT("  "); FAULT_PRINT_HEX(fault_record.stack[i]); FAULT_NEWLINE();
+    }
+#endif
+}
+
+static void
+report_memmanage_fault(void)
+{
+    uint32_t cfsr = CFSR;
+
+    FAULT_PRINTLN("MemManage fault status:");
+
+    if (CHECK_BIT(cfsr, MMARVALID)) {
+        FAULT_PRINTLN(" - MMAR holds a valid address.");
+        report_mpu_regions(fault_record.mmfar);
+    } else {
+        FAULT_PRINTLN(" - MMAR holds an invalid address.");
+    }
+
+    if (CHECK_BIT(cfsr, MLSPERR)) {
+        FAULT_PRINTLN(" - Fault occurred during floating-point lazy state preservation.");
+    }
+
+    if (CHECK_BIT(cfsr, MSTKERR)) {
+        FAULT_PRINTLN(" - Stacking has caused an access violation.");
+    }
+
+    if (CHECK_BIT(cfsr, MUNSTKERR)) {
+        FAULT_PRINTLN(" - Unstacking has caused an access violation.");
+    }
+
+    if (CHECK_BIT(cfsr, DACCVIOL)) {
+        FAULT_PRINTLN(" - Load or store at a location that does not permit the operation.");
+    }
+
+    if (CHECK_BIT(cfsr, IACCVIOL)) {
+        FAULT_PRINTLN(" - Instruction fetch from a location that does not permit execution.");
+    }
+}
+
+#ifdef MPU_REGION_MATCH
+/**
+ * @brief  Check whether the region covers the address and decode its permissions
+ * @param  rbar: Region base address register.
+ * @param  rasr: Region attribute and size register, RLAR on ARMv8-M.
+ * @param  address: Address to check.
+ * @param  privileged: Non-zero for privileged access.
+ * @param  *access: Set to ACCESS_* flags allowed by the region.
+ * @return Non-zero if the region is enabled and covers the address.
+ */
+static int
+mpu_region_match(uint32_t rbar, uint32_t rasr, uint32_t address, int privileged, uint32_t *access)
+{
+#ifdef MPU_ARMV8M
+    /* AP: 00 - privileged RW, 01 - RW, 10 - privileged RO, 11 - RO. */
+    static const uint8_t ap_unpriv[4] = { 0u, ACCESS_READ | ACCESS_WRITE, 0u, ACCESS_READ };
+    static const uint8_t ap_priv[4]   = { ACCESS_READ | ACCESS_WRITE, ACCESS_READ | ACCESS_WRITE,
+                                          ACCESS_READ, ACCESS_READ };
+    uint32_t ap = MPU_RBAR_AP(rbar);
+
+    if (!CHECK_BIT(rasr, MPU_RLAR_EN)
+            || (address < (rbar & MPU_ADDR_MASK))
+            || (address > ((rasr & MPU_ADDR_MASK) | ~MPU_ADDR_MASK))) {
+        return 0;
+    }
+    *access = privileged ? ap_priv[ap] : ap_unpriv[ap];
+    if (!CHECK_BIT(rbar, MPU_RBAR_XN) && (*access & ACCESS_READ)) {
+        *access |= ACCESS_EXEC;
+    }
+#else
+    /* AP: 000 - none, 001 - privileged RW, 010 - privileged RW, unprivileged RO,
+     * 011 - RW, 101 - privileged RO, 110 and 111 - RO. */
+    static const uint8_t ap_unpriv[8] = { 0u, 0u, ACCESS_READ, ACCESS_READ | ACCESS_WRITE,
+                                          0u, 0u, ACCESS_READ, ACCESS_READ };
+    static const uint8_t ap_priv[8]   = { 0u, ACCESS_READ | ACCESS_WRITE, ACCESS_READ | ACCESS_WRITE,
+                                          ACCESS_READ | ACCESS_WRITE, 0u, ACCESS_READ,
+                                          ACCESS_READ, ACCESS_READ };
+    uint32_t size_log2 = MPU_RASR_SIZE(rasr) + 1u;
+    uint32_t offset;
+
+    if (!CHECK_BIT(rasr, MPU_RASR_ENABLE)) {
+        return 0;
+    }
+    offset = address - (rbar & MPU_ADDR_MASK & ~((uint32_t)((1ull << size_log2) - 1u)));
+    if ((size_log2 < 32u) && (offset >> size_log2)) {
+        return 0;
+    }
+    /* Regions of 256 bytes and more consist of 8 subregions, each can be disabled. */
+    if ((size_log2 >= 8u) && CHECK_BIT(MPU_RASR_SRD(rasr), offset >> (size_log2 - 3u))) {
+        return 0;
+    }
+    *access = privileged ? ap_priv[MPU_RASR_AP(rasr)] : ap_unpriv[MPU_RASR_AP(rasr)];
+    if (!CHECK_BIT(rasr, MPU_RASR_XN) && (*access & ACCESS_READ)) {
+        *access |= ACCESS_EXEC;
+    }
+#endif
+    return 1;
+}
+#endif
+
+#ifdef FAULT_CAPTURE_MPU
+/**
+ * @brief  Print access permissions
+ */
+static void
+report_access(uint32_t access)
+{
+    FAULT_PRINT((access & ACCESS_READ) ? "read allowed, " : "read denied, ");
+    FAULT_PRINT((access & ACCESS_WRITE) ? "write allowed, " : "write denied, ");
+    FAULT_PRINTLN((access & ACCESS_EXEC) ? "execute allowed." : "execute denied.");
+}
+#endif
+
+static void
+report_mpu_regions(uint32_t address)
+{
+#ifdef FAULT_CAPTURE_MPU
+    uint32_t access = 0u;
+    int privileged;
+    int matched = 0;
+    uint32_t i;
+
+    if (fault_record.mpu_regions == 0u) {
+        return;
+    }
+
+    /* Handler mode is always privileged, thread mode depends on CONTROL.nPRIV. */
+    privileged = !CHECK_BIT(fault_record.exc_return, EXC_RETURN_MODE)
+              || !CHECK_BIT(fault_record.control, CONTROL_NPRIV);
+    FAULT_PRINTLN(privileged ? " - Faulting code is privileged." : " - Faulting code is unprivileged.");
+
+    if (!CHECK_BIT(fault_record.mpu_ctrl, MPU_CTRL_ENABLE)) {
+        FAULT_PRINTLN(" - MPU is disabled.");
+        return;
+    }
+
+    /* Highest numbered region takes priority on ARMv7-M, overlaps fault on ARMv8-M. */
+    for (i = fault_record.mpu_regions; i-- > 0u;) {
+        uint32_t region_access;
+
+        if (mpu_region_match(fault_record.mpu_rbar[i], fault_record.mpu_rasr[i],
+                             address, privileged, &region_access)) {
+            FAULT_PRINT(" - MPU region "); FAULT_PRINT_HEX(i); FAULT_PRINT(" covers MMAR: ");
+            report_access(region_access);
+            if (!matched) {
+                access = region_access;
+            }
+            matched++;
+        }
+    }
+
+    if (!matched) {
+        if (privileged && CHECK_BIT(fault_record.mpu_ctrl, MPU_CTRL_PRIVDEFENA)) {
+            FAULT_PRINTLN(" - No MPU region covers MMAR, background map applies.");
+        } else {
+            FAULT_PRINTLN(" - No MPU region covers MMAR and background map is not available.");
+        }
+        return;
+    }
+#ifdef MPU_ARMV8M
+    if (matched > 1) {
+        FAULT_PRINTLN(" - Address is covered by overlapping regions, any access faults.");
+        return;
+    }
+#endif
+    FAULT_PRINT(" - Effective permissions: ");
+    report_access(access);
+#else
+    (void)address;
+#endif
 }
 
 static void
@@ -329,6 +3182,9 @@ report_usage_fault(void)
 
     if (CHECK_BIT(cfsr, UNDEFINSTR)) {
         FAULT_PRINTLN(" - The processor has attempted to execute an undefined instruction.");
+        if (fault_record.code == FAULT_SOFT_CHECK) {
+            FAULT_PRINT(" - FAULT_CHECK failed, ID: "); FAULT_PRINT_HEX(fault_record.line); FAULT_NEWLINE();
+        }
     }
 }
 
@@ -0,0 +1,923 @@
+/**
+ * @file    fault_handler.h
+ * @brief   Public interface of the fault handler.
+ *          - Layout of the fault record filled by every handler.
+ *          - Software fault capture for assert, abort and similar paths.
+ *          - FAULT_CHECK() asserts trapping through UDF instruction.
+ *          - Non-fatal snapshots of the same state a fault captures.
+ *          - Check kinds reported by UBSan minimal runtime (fault_ubsan.c).
+ *          - Descriptor table of peripheral registers captured on bus faults.
+ *          - MPU configuration captured on MemManage faults.
+ *          - Per fault class handling policy.
+ *          - Scatter-gather binary output of the captured fault.
+ *          - Registration of memory regions copied into the record.
+ *          - Sampling profiler built on the fault handler frame extraction.
+ *          - MPU region virtualization driven by MemManage faults.
+ *          - Lazy zeroing of large buffers on first touch.
+ *          - Lazy FPU enable on the first FP instruction of a task.
+ *          - Emulation of undefined instructions through a dispatch table.
+ *          - Recoverable divide by zero with per-PC counters.
+ *          - Emulation of unaligned loads and stores with byte accesses.
+ *          - FP state capture, including lazy FP stacking faults.
+ *          - Type-length-value record format with optional sections.
+ *          - Compile-time record size and capture cycle planner.
+ *          - Image table for symbolization of multi-image systems.
+ *          - Crash summary in backup domain registers.
+ *          - Reset cause attribution with the retained handler state.
+ */
+
+#ifndef FAULT_HANDLER_H
+#define FAULT_HANDLER_H
+
+#include "fault_config.h"
+
+#include <stdint.h>
+
+/* Fault classes, stored in fault_record_t::fault_class. */
+#define FAULT_CLASS_NONE        0
+#define FAULT_CLASS_HARD        1
+#define FAULT_CLASS_MEMMANAGE   2
+#define FAULT_CLASS_BUS         3
+#define FAULT_CLASS_USAGE       4
+#define FAULT_CLASS_SOFTWARE    5
+#define FAULT_CLASS_SNAPSHOT    6       /**< fault_snapshot_now(), code holds the tag. */
+#define FAULT_CLASS_NESTED      7       /**< Fault raised while a fault is being handled. */
+#define FAULT_CLASS_HANG        8       /**< Watchdog early warning, frame of the hung code. */
+#define FAULT_CLASS_ANY         0xff    /**< Matches any class in fault_policy_t. */
+
+/* Software fault codes for fault_capture_soft(). Application codes start at FAULT_SOFT_USER. */
+#define FAULT_SOFT_ASSERT       1u
+#define FAULT_SOFT_STACK_CHK    2u
+#define FAULT_SOFT_ABORT        3u
+#define FAULT_SOFT_TERMINATE    4u
+#define FAULT_SOFT_HAL          5u
+#define FAULT_SOFT_CHECK        6u      /**< FAULT_CHECK() trap, line holds the check ID. */
+#define FAULT_SOFT_UBSAN        7u      /**< UBSan check, file_id holds FAULT_UBSAN_*, line the caller PC. */
+#define FAULT_SOFT_USER         0x100u
+
+/* UBSan check kinds, reported by fault_ubsan.c. */
+#define FAULT_UBSAN_TYPE_MISMATCH           0u
+#define FAULT_UBSAN_ALIGNMENT_ASSUMPTION    1u
+#define FAULT_UBSAN_ADD_OVERFLOW            2u
+#define FAULT_UBSAN_SUB_OVERFLOW            3u
+#define FAULT_UBSAN_MUL_OVERFLOW            4u
+#define FAULT_UBSAN_NEGATE_OVERFLOW         5u
+#define FAULT_UBSAN_DIVREM_OVERFLOW         6u
+#define FAULT_UBSAN_SHIFT_OUT_OF_BOUNDS     7u
+#define FAULT_UBSAN_OUT_OF_BOUNDS           8u
+#define FAULT_UBSAN_BUILTIN_UNREACHABLE     9u
+#define FAULT_UBSAN_MISSING_RETURN          10u
+#define FAULT_UBSAN_VLA_BOUND_NOT_POSITIVE  11u
+#define FAULT_UBSAN_FLOAT_CAST_OVERFLOW     12u
+#define FAULT_UBSAN_LOAD_INVALID_VALUE      13u
+#define FAULT_UBSAN_INVALID_BUILTIN         14u
+#define FAULT_UBSAN_FUNCTION_TYPE_MISMATCH  15u
+#define FAULT_UBSAN_IMPLICIT_CONVERSION     16u
+#define FAULT_UBSAN_NONNULL_ARG             17u
+#define FAULT_UBSAN_NONNULL_RETURN          18u
+#define FAULT_UBSAN_NULLABILITY_ARG         19u
+#define FAULT_UBSAN_NULLABILITY_RETURN      20u
+#define FAULT_UBSAN_POINTER_OVERFLOW        21u
+#define FAULT_UBSAN_CFI_CHECK_FAIL          22u
+#define FAULT_UBSAN_KINDS                   23u
+
+/* fault_periph_desc_t::flags */
+#define FAULT_PERIPH_SIDE_EFFECTS           0x01u   /**< Reading the register changes its state. */
+
+/* Maximum number of MPU regions stored in the record. */
+#define FAULT_MPU_MAX_REGIONS               16u
+
+/* CFSR bits, for fault_policy_t::cfsr_mask. */
+#define FAULT_CFSR_IACCVIOL     (1u << 0)
+#define FAULT_CFSR_DACCVIOL     (1u << 1)
+#define FAULT_CFSR_MUNSTKERR    (1u << 3)
+#define FAULT_CFSR_MSTKERR      (1u << 4)
+#define FAULT_CFSR_MLSPERR      (1u << 5)
+#define FAULT_CFSR_MMARVALID    (1u << 7)
+#define FAULT_CFSR_IBUSERR      (1u << 8)
+#define FAULT_CFSR_PRECISERR    (1u << 9)
+#define FAULT_CFSR_IMPRECISERR  (1u << 10)
+#define FAULT_CFSR_UNSTKERR     (1u << 11)
+#define FAULT_CFSR_STKERR       (1u << 12)
+#define FAULT_CFSR_LSPERR       (1u << 13)
+#define FAULT_CFSR_BFARVALID    (1u << 15)
+#define FAULT_CFSR_UNDEFINSTR   (1u << 16)
+#define FAULT_CFSR_INVSTATE     (1u << 17)
+#define FAULT_CFSR_INVPC        (1u << 18)
+#define FAULT_CFSR_NOCP         (1u << 19)
+#define FAULT_CFSR_UNALIGNED    (1u << 24)
+#define FAULT_CFSR_DIVBYZERO    (1u << 25)
+
+/* Capture depth, fault_policy_t::depth flags. */
+#define FAULT_DEPTH_NONE        0x00u   /**< Keep the record as it is. */
+#define FAULT_DEPTH_REGS        0x01u   /**< R0-R12 and FP state, PC, LR, xPSR, SP and fault status are always kept. */
+#define FAULT_DEPTH_STACK       0x02u   /**< Stack window. */
+#define FAULT_DEPTH_PERIPH      0x04u   /**< Peripheral registers. */
+#define FAULT_DEPTH_MPU         0x08u   /**< MPU regions, if MMAR is valid. */
+#define FAULT_DEPTH_REGIONS     0x10u   /**< Memory regions registered with fault_capture_region(). */
+#define FAULT_DEPTH_FULL        0x1fu
+
+/* FP state, fault_record_t::fp_flags (FAULT_CAPTURE_FP). */
+#define FAULT_FP_LAZY_ERROR     0x01u   /**< MLSPERR or LSPERR, fault during lazy FP state preservation. */
+#define FAULT_FP_PENDING        0x02u   /**< Lazy preservation was pending, fp_regs read from FP registers. */
+#define FAULT_FP_CAPTURED       0x04u   /**< fp_regs and fpscr are valid. */
+
+/* Output, fault_policy_t::sinks flags. */
+#define FAULT_SINK_REPORT       0x01u   /**< Print captured registers. */
+#define FAULT_SINK_DECODE       0x02u   /**< Print fault status analysis. */
+#define FAULT_SINK_BINARY       0x04u   /**< Pass the binary record to FAULT_SINK_WRITEV. */
+
+/* Post-fault action, fault_policy_t::action. */
+#define FAULT_ACTION_DEFAULT    0u      /**< FAULT_BREAKPOINT / FAULT_REBOOT / FAULT_STOP from the config. */
+#define FAULT_ACTION_REBOOT     1u
+#define FAULT_ACTION_STOP       2u
+#define FAULT_ACTION_BREAKPOINT 3u      /**< Breakpoint, then stop. */
+#define FAULT_ACTION_RETURN     4u      /**< Return to the faulting code. */
+
+/* Value of fault_record_t::magic when the record holds a captured fault. */
+#define FAULT_RECORD_MAGIC      0xFA017EC0u
+
+/* Value of fault_stream_header_t::magic. */
+#define FAULT_STREAM_MAGIC      0xFA015EC0u
+
+/* Value of the magic field of counters in FAULT_RECORD_SECTION once they are initialized. */
+#define FAULT_STATS_MAGIC       0xFA0157A7u
+
+/* Reset causes, fault_reset_info_t::cause. FAULT_RESET_CAUSE() returns one of
+ * FAULT_RESET_UNKNOWN - FAULT_RESET_LOCKUP. */
+#define FAULT_RESET_UNKNOWN     0u
+#define FAULT_RESET_POWER_ON    1u
+#define FAULT_RESET_BROWNOUT    2u
+#define FAULT_RESET_PIN         3u
+#define FAULT_RESET_WATCHDOG    4u
+#define FAULT_RESET_SOFTWARE    5u      /**< Software reset not requested by the fault handler. */
+#define FAULT_RESET_LOCKUP      6u
+#define FAULT_RESET_HANDLER     7u      /**< Reset requested by the fault handler. */
+#define FAULT_RESET_HANDLER_CUT 8u      /**< Watchdog reset while the fault handler was running. */
+
+/* Fault handler state retained over reset, fault_reset_info_t::handler_state. */
+#define FAULT_HANDLER_IDLE      0u
+#define FAULT_HANDLER_RUNNING   1u      /**< Capturing or reporting a fault. */
+#define FAULT_HANDLER_DONE      2u      /**< Fault handled, stopped or waiting in breakpoint. */
+#define FAULT_HANDLER_RESET     3u      /**< Reset requested. */
+
+/* Upper half of the first backup register holding a crash summary. */
+#define FAULT_BACKUP_MAGIC      0xFA0Bu
+
+/* Value of fault_tlv_header_t::magic and format version. */
+#define FAULT_TLV_MAGIC         0xFA0171C0u
+#define FAULT_TLV_VERSION       1u
+
+/* TLV section types, values are fault_record_t fields in record order. Types
+ * a decoder does not know are skipped using the length. */
+#define FAULT_TLV_REGS          1u      /**< frame, callee, sp, exc_return. */
+#define FAULT_TLV_STATUS        2u      /**< hfsr, cfsr, mmfar, bfar, afsr. */
+#define FAULT_TLV_SOFT          3u      /**< code, file_id, line. */
+#define FAULT_TLV_TASK          4u      /**< task. */
+#define FAULT_TLV_CYCLES        5u      /**< capture_cycles, output_cycles. */
+#define FAULT_TLV_MPU           6u      /**< control, mpu_ctrl, mpu_regions, mpu_regions RBAR values, same number of RASR values. */
+#define FAULT_TLV_PERIPH        7u      /**< periph bytes. */
+#define FAULT_TLV_REGIONS       8u      /**< region_count, region_count fault_region_t, copied data. */
+#define FAULT_TLV_FP            9u      /**< fp_flags, fpccr, fpcar, fp_regs, fpscr. */
+#define FAULT_TLV_STACK         10u     /**< Stack window words starting at sp. */
+#define FAULT_TLV_IMAGES        11u     /**< image_count, image_count fault_image_t. */
+#define FAULT_TLV_LAST          FAULT_TLV_IMAGES    /**< Highest section type, new types are added after it. */
+
+#ifndef FAULT_IMAGE_ID_BYTES
+#define FAULT_IMAGE_ID_BYTES    8u      /**< Leading build ID bytes kept per image, multiple of 4. */
+#endif
+
+/**
+ * @brief Registers stacked by the processor on exception entry, in stacking order.
+ */
+typedef struct {
+    uint32_t r0;
+    uint32_t r1;
+    uint32_t r2;
+    uint32_t r3;
+    uint32_t r12;
+    uint32_t lr;
+    uint32_t pc;
+    uint32_t psr;
+} fault_stack_frame_t;
+
+/**
+ * @brief Registers not stacked by the processor, saved by the handler entry.
+ */
+typedef struct {
+    uint32_t r4;
+    uint32_t r5;
+    uint32_t r6;
+    uint32_t r7;
+    uint32_t r8;
+    uint32_t r9;
+    uint32_t r10;
+    uint32_t r11;
+} fault_callee_regs_t;
+
+/**
+ * @brief How faults of one class are handled. Entries of FAULT_POLICY_TABLE are
+ * checked in order, the first one with matching class and CFSR bits applies.
+ */
+typedef struct {
+    uint32_t cfsr_mask;     /**< Entry applies if any of these CFSR bits is set, 0 - always. */
+    uint8_t  fault_class;   /**< FAULT_CLASS_* or FAULT_CLASS_ANY. */
+    uint8_t  depth;         /**< FAULT_DEPTH_* flags. */
+    uint8_t  sinks;         /**< FAULT_SINK_* flags. */
+    uint8_t  persist;       /**< Non-zero to run FAULT_PERSIST_HOOK. */
+    uint8_t  action;        /**< FAULT_ACTION_*. */
+} fault_policy_t;
+
+/**
+ * @brief Initializer of a fault_policy_t entry, for FAULT_POLICY_TABLE.
+ */
+#define FAULT_POLICY(CLASS, CFSR_MASK, DEPTH, SINKS, PERSIST, ACTION) \
+    { (CFSR_MASK), (CLASS), (DEPTH), (SINKS), (PERSIST), (ACTION) }
+
+/**
+ * @brief One segment of scatter-gather output.
+ */
+typedef struct {
+    const void *base;
+    uint32_t len;
+} fault_iovec_t;
+
+/**
+ * @brief First segment of binary output, followed by the record and the stack window.
+ */
+typedef struct {
+    uint32_t magic;         /**< FAULT_STREAM_MAGIC. */
+    uint16_t record_size;   /**< Size of fault_record_t segment. */
+    uint16_t stack_size;    /**< Size of the stack window segment in bytes. */
+} fault_stream_header_t;
+
+/**
+ * @brief Fixed header of a TLV record. Holds the fields needed for triage at known offsets,
+ * sections follow at header_size.
+ */
+typedef struct {
+    uint32_t magic;         /**< FAULT_TLV_MAGIC. */
+    uint16_t version;       /**< FAULT_TLV_VERSION. */
+    uint16_t header_size;   /**< Offset of the first section. */
+    uint32_t total_size;    /**< Header and all sections. */
+    uint32_t fault_class;   /**< FAULT_CLASS_*. */
+    uint32_t pc;
+    uint32_t lr;
+    uint32_t cfsr;
+    uint32_t code;          /**< Software fault code, FAULT_SOFT_*. */
+} fault_tlv_header_t;
+
+/**
+ * @brief TLV section header. len bytes of value follow, padded to a multiple of 4.
+ */
+typedef struct {
+    uint16_t type;          /**< FAULT_TLV_*. */
+    uint16_t len;           /**< Value length without padding. */
+} fault_tlv_t;
+
+/**
+ * @brief Firmware image (bootloader, application slot, overlay) present in memory.
+ */
+typedef struct {
+    uint8_t  build_id[FAULT_IMAGE_ID_BYTES];    /**< Leading bytes of the GNU build ID. */
+    uint32_t load_address;  /**< Address the image runs at. */
+    uint32_t size;          /**< Size of the image in bytes. */
+} fault_image_t;
+
+/**
+ * @brief Crash summary kept in backup domain registers (FAULT_BACKUP_WORDS).
+ * Fields after signature are stored only if there are enough registers, 0 otherwise.
+ */
+typedef struct {
+    uint32_t fault_class;   /**< FAULT_CLASS_* of the last fault. */
+    uint32_t count;         /**< Faults stored since fault_backup_clear(), saturates at 255. */
+    uint32_t pc;
+    uint32_t lr;
+    uint32_t cfsr;
+    uint32_t signature;     /**< Upper 16 bits of a hash of class, PC, LR, CFSR and software fault fields. */
+    uint32_t code;          /**< 6 registers and more. */
+    uint32_t file_id;       /**< 7 registers and more. */
+    uint32_t line;          /**< 8 registers and more. */
+    uint32_t hfsr;          /**< 9 registers and more. */
+    uint32_t mmfar;         /**< 10 registers and more. */
+    uint32_t bfar;          /**< 11 registers and more. */
+} fault_backup_summary_t;
+
+/**
+ * @brief Cause of the last reset, see fault_reset_attribute().
+ */
+typedef struct {
+    uint32_t cause;         /**< FAULT_RESET_*, hardware cause refined with the handler state. */
+    uint32_t hw_cause;      /**< Cause reported by FAULT_RESET_CAUSE(). */
+    uint32_t handler_state; /**< FAULT_HANDLER_* when the reset happened. */
+    uint32_t record_valid;  /**< Non-zero if fault_record holds a fault captured before the reset. */
+} fault_reset_info_t;
+
+/**
+ * @brief Memory region copied into the record.
+ */
+typedef struct {
+    uint32_t address;
+    uint32_t len;
+} fault_region_t;
+
+/**
+ * @brief Group of consecutive peripheral registers captured on bus and hard faults.
+ * The table is generated from SVD by tools/fault_periph_gen.py.
+ */
+typedef struct {
+    uint32_t address;       /**< Address of the first register. */
+    uint16_t name_id;       /**< Name of the first register, index into the generated names file. */
+    uint8_t  width;         /**< Register width in bytes: 1, 2 or 4. */
+    uint8_t  count;         /**< Number of consecutive registers. */
+    uint8_t  flags;         /**< FAULT_PERIPH_* flags. */
+} fault_periph_desc_t;
+
+/**
+ * @brief Everything captured about the last fault.
+ * For software faults frame.pc is the return address of the fault_capture_soft() call
+ * and exc_return is 0.
+ */
+typedef struct {
+    uint32_t magic;         /**< FAULT_RECORD_MAGIC once filled. */
+    uint32_t fault_class;   /**< One of FAULT_CLASS_*. */
+    fault_stack_frame_t frame;
+    fault_callee_regs_t callee;
+    uint32_t sp;            /**< Stack pointer value before the fault. */
+    uint32_t exc_return;
+    uint32_t hfsr;
+    uint32_t cfsr;
+    uint32_t mmfar;
+    uint32_t bfar;
+    uint32_t afsr;
+    uint32_t code;          /**< Software fault code, FAULT_SOFT_*. */
+    uint32_t file_id;       /**< Software fault file identifier. */
+    uint32_t line;          /**< Software fault line number. */
+#ifdef FAULT_CURRENT_TASK
+    uint32_t task;          /**< Current task reported by FAULT_CURRENT_TASK(). */
+#endif
+#ifdef FAULT_MEASURE_CYCLES
+    uint32_t capture_cycles;    /**< DWT cycles spent in capture, copies left running on DMA excluded. */
+    uint32_t output_cycles;     /**< DWT cycles of report, hooks and binary output, 0 for snapshots. */
+#endif
+#ifdef FAULT_CAPTURE_MPU
+    uint32_t control;       /**< CONTROL register, privilege level of thread mode. */
+    uint32_t mpu_ctrl;      /**< MPU_CTRL register. */
+    uint32_t mpu_regions;   /**< Number of valid entries in mpu_rbar / mpu_rasr, 0 if not captured. */
+    uint32_t mpu_rbar[FAULT_MPU_MAX_REGIONS];
+    uint32_t mpu_rasr[FAULT_MPU_MAX_REGIONS];   /**< RASR, or RLAR on ARMv8-M. */
+#endif
+#ifdef FAULT_CAPTURE_FP
+    uint32_t fp_flags;      /**< FAULT_FP_* flags. */
+    uint32_t fpccr;         /**< FPCCR register. */
+    uint32_t fpcar;         /**< FPCAR register, reserved FP space of the last extended frame. */
+    uint32_t fp_regs[16];   /**< S0-S15 of the interrupted code. */
+    uint32_t fpscr;
+#endif
+#ifdef FAULT_IMAGE_SLOTS
+    uint32_t image_count;   /**< Number of valid entries in image. */
+    fault_image_t image[FAULT_IMAGE_SLOTS];     /**< Images registered with fault_register_image(). */
+#endif
+#ifdef FAULT_PERIPH_BUDGET
+    uint32_t periph_bytes;  /**< Number of valid bytes in periph. */
+    uint8_t  periph[FAULT_PERIPH_BUDGET];   /**< Register values in fault_periph_table order. */
+#endif
+#ifdef FAULT_CAPTURE_REGIONS
+    uint32_t region_count;  /**< Number of valid entries in region. */
+    fault_region_t region[FAULT_CAPTURE_REGIONS];   /**< Copied regions, their data follows in region_data. */
+    uint8_t  region_data[FAULT_CAPTURE_REGION_BYTES];
+#endif
+#ifdef FAULT_STACK_WINDOW_WORDS
+    uint32_t stack_words;   /**< Number of valid words in stack. */
+    uint32_t stack[FAULT_STACK_WINDOW_WORDS];   /**< Stack contents starting at sp. */
+#endif
+} fault_record_t;
+
+/**
+ * @brief Record of the last fault. Placed into FAULT_RECORD_SECTION if it is defined.
+ */
+extern fault_record_t fault_record;
+
+#ifdef FAULT_SNAPSHOT_SLOTS
+/**
+ * @brief Snapshots taken by fault_snapshot_now(), used as a ring.
+ */
+extern fault_record_t fault_snapshots[FAULT_SNAPSHOT_SLOTS];
+#endif
+
+#ifdef FAULT_PERIPH_BUDGET
+/**
+ * @brief Peripheral registers to capture, provided by the application (usually generated).
+ */
+extern const fault_periph_desc_t fault_periph_table[];
+extern const uint32_t fault_periph_table_size;
+#endif
+
+/**
+ * @brief Profiler sample: interrupted PC and LR.
+ */
+typedef struct {
+    uint32_t pc;
+    uint32_t lr;
+} fault_profiler_sample_t;
+
+/**
+ * @brief Profiler counters.
+ */
+typedef struct {
+    uint32_t samples;       /**< Samples stored. */
+    uint32_t dropped;       /**< Samples lost because the ring was full. */
+    uint32_t cycles_max;    /**< Longest sample, DWT cycles (FAULT_MEASURE_CYCLES). */
+} fault_profiler_stats_t;
+
+#ifdef FAULT_PROFILER_SAMPLES
+/**
+ * @brief Profiler counters, updated by the sampling interrupt.
+ */
+extern fault_profiler_stats_t fault_profiler_stats;
+#endif
+
+/**
+ * @brief Logical MPU region, loaded into a hardware region on first access.
+ */
+typedef struct {
+    uint32_t rbar;          /**< RBAR value, base address and on ARMv8-M access permissions. */
+    uint32_t rasr;          /**< RASR value with ENABLE bit set, RLAR on ARMv8-M. */
+    uint32_t task_mask;     /**< Bit N set - task with FAULT_CURRENT_TASK_ID() N may use the region. */
+} fault_mpu_vregion_t;
+
+/**
+ * @brief MPU virtualization counters.
+ */
+typedef struct {
+    uint32_t swaps;         /**< Faults resolved by loading a region. */
+    uint32_t denied;        /**< Faults no logical region allowed, reported as usual. */
+    uint32_t cycles_total;  /**< Total swap time, DWT cycles (FAULT_MEASURE_CYCLES). */
+    uint32_t cycles_max;    /**< Longest swap, DWT cycles (FAULT_MEASURE_CYCLES). */
+} fault_mpu_virt_stats_t;
+
+#ifdef FAULT_MPU_VIRT_FIRST
+/**
+ * @brief Protection table of logical regions, provided by the application.
+ */
+extern const fault_mpu_vregion_t fault_mpu_vregions[];
+extern const uint32_t fault_mpu_vregions_size;
+
+/**
+ * @brief MPU virtualization counters, miss rate is swaps per unit of run time.
+ */
+extern fault_mpu_virt_stats_t fault_mpu_virt_stats;
+#endif
+
+/**
+ * @brief Lazy zeroing counters.
+ */
+typedef struct {
+    uint32_t blocks;        /**< Blocks zeroed on first touch. */
+    uint32_t cycles_max;    /**< Longest block zeroing, DWT cycles (FAULT_MEASURE_CYCLES). */
+} fault_lazy_zero_stats_t;
+
+#ifdef FAULT_LAZY_ZERO_REGION
+/**
+ * @brief Place a buffer into the lazily zeroed section instead of .bss.
+ */
+#define FAULT_LAZY_ZERO     __attribute__((section(".lazy_bss")))
+
+/**
+ * @brief Lazy zeroing counters.
+ */
+extern fault_lazy_zero_stats_t fault_lazy_zero_stats;
+#endif
+
+#ifdef FAULT_LAZY_FPU
+/**
+ * @brief Number of NOCP UsageFaults resolved by enabling the FPU.
+ */
+extern uint32_t fault_lazy_fpu_enables;
+#endif
+
+/**
+ * @brief Registers of the code whose instruction is being emulated.
+ */
+typedef struct {
+    uint32_t *frame;        /**< Stacked R0-R3, R12, LR, PC, xPSR. */
+    uint32_t *callee;       /**< Saved R4-R11, restored on return from the fault. */
+    uint32_t sp;            /**< SP of the interrupted code, read only. */
+} fault_emu_ctx_t;
+
+/**
+ * @brief Instruction emulation handler.
+ * @param *ctx: Registers of the interrupted code, see fault_emu_reg() and fault_emu_set_reg().
+ * @param instr: Instruction, 0x0000iiii for 16-bit ones, first halfword in the upper half for 32-bit ones.
+ * @return Non-zero if the instruction has been emulated, zero to report the fault as usual.
+ */
+typedef int (*fault_emu_handler_t)(fault_emu_ctx_t *ctx, uint32_t instr);
+
+/**
+ * @brief Dispatch table entry, storage is provided by the application.
+ */
+typedef struct {
+    uint32_t mask;                  /**< Instruction bits to compare. */
+    uint32_t match;                 /**< Value of the compared bits. */
+    fault_emu_handler_t handler;    /**< Handler of matching instructions. */
+    uint32_t count;                 /**< Instructions emulated. */
+    uint32_t cycles_total;          /**< Total emulation time, DWT cycles (FAULT_MEASURE_CYCLES). */
+    uint32_t cycles_max;            /**< Longest emulation, DWT cycles (FAULT_MEASURE_CYCLES). */
+} fault_emu_entry_t;
+
+#ifdef FAULT_DIV0_RESULT
+#ifndef FAULT_DIV0_SLOTS
+#define FAULT_DIV0_SLOTS    8u
+#endif
+
+/**
+ * @brief Divisions by zero resumed with FAULT_DIV0_RESULT.
+ */
+typedef struct {
+    uint32_t magic;                     /**< FAULT_STATS_MAGIC, otherwise counters are zeroed first. */
+    uint32_t pc[FAULT_DIV0_SLOTS];      /**< Address of SDIV or UDIV instruction, 0 - slot is free. */
+    uint32_t count[FAULT_DIV0_SLOTS];   /**< Number of divisions by zero at the address. */
+    uint32_t dropped;                   /**< Divisions by zero at addresses that did not fit. */
+    uint32_t cycles_max;                /**< Longest trap, DWT cycles (FAULT_MEASURE_CYCLES). */
+} fault_div0_stats_t;
+
+/**
+ * @brief Divide by zero counters. Placed into FAULT_RECORD_SECTION if it is defined.
+ */
+extern fault_div0_stats_t fault_div0_stats;
+#endif
+
+#ifdef FAULT_UNALIGNED_EMULATE
+#ifndef FAULT_UNALIGNED_SLOTS
+#define FAULT_UNALIGNED_SLOTS   8u
+#endif
+
+/**
+ * @brief Unaligned accesses done with byte accesses by the handler.
+ */
+typedef struct {
+    uint32_t magic;                         /**< FAULT_STATS_MAGIC, otherwise counters are zeroed first. */
+    uint32_t pc[FAULT_UNALIGNED_SLOTS];     /**< Address of the load or store, 0 - slot is free. */
+    uint32_t count[FAULT_UNALIGNED_SLOTS];  /**< Number of emulated accesses at the address. */
+    uint32_t dropped;                       /**< Emulated accesses at addresses that did not fit. */
+    uint32_t cycles_max;                    /**< Longest emulation, DWT cycles (FAULT_MEASURE_CYCLES). */
+} fault_unaligned_stats_t;
+
+/**
+ * @brief Unaligned access counters. Placed into FAULT_RECORD_SECTION if it is defined.
+ */
+extern fault_unaligned_stats_t fault_unaligned_stats;
+#endif
+
+/**
+ * @brief Counters of UBSan checks that were allowed to continue (FAULT_UBSAN_RECOVER).
+ */
+typedef struct {
+    uint32_t magic;                         /**< FAULT_STATS_MAGIC, otherwise counters are zeroed first. */
+    uint32_t count[FAULT_UBSAN_KINDS];      /**< Number of failed checks of each kind. */
+    uint32_t last_pc[FAULT_UBSAN_KINDS];    /**< Caller PC of the last failed check of each kind. */
+} fault_ubsan_stats_t;
+
+/**
+ * @brief UBSan counters, defined in fault_ubsan.c. Placed into FAULT_RECORD_SECTION if it is defined.
+ */
+extern fault_ubsan_stats_t fault_ubsan_stats;
+
+/* Capture plan: worst-case sizes and capture cycles of the enabled record parts,
+ * checked at compile time against FAULT_RECORD_SLOT_SIZE, FAULT_RECORD_SECTION_SIZE
+ * and FAULT_CAPTURE_CYCLE_BUDGET if they are defined. Cycle costs are estimates for
+ * CPU copies from zero wait state memory and can be overridden in fault_config.h. */
+#ifndef FAULT_PLAN_CYCLES_BASE
+#define FAULT_PLAN_CYCLES_BASE          150u    /**< Entry, frame, fault status registers, policy lookup. */
+#endif
+#ifndef FAULT_PLAN_CYCLES_PER_WORD
+#define FAULT_PLAN_CYCLES_PER_WORD      4u      /**< Word copied from the stack or a memory region. */
+#endif
+#ifndef FAULT_PLAN_CYCLES_PER_PERIPH
+#define FAULT_PLAN_CYCLES_PER_PERIPH    6u      /**< Peripheral register byte, includes bus latency. */
+#endif
+#ifndef FAULT_PLAN_CYCLES_PER_MPU
+#define FAULT_PLAN_CYCLES_PER_MPU       10u     /**< MPU region read through RNR. */
+#endif
+#ifndef FAULT_PLAN_CYCLES_FP
+#define FAULT_PLAN_CYCLES_FP            40u     /**< S0-S15 and FPSCR. */
+#endif
+
+/* TLV section size with its header and padding. */
+#define FAULT_PLAN_TLV(LEN)             (sizeof(fault_tlv_t) + (((LEN) + 3u) & ~3u))
+
+#ifdef FAULT_CURRENT_TASK
+#define FAULT_PLAN_TLV_TASK             FAULT_PLAN_TLV(4u)
+#else
+#define FAULT_PLAN_TLV_TASK             0u
+#endif
+#ifdef FAULT_MEASURE_CYCLES
+#define FAULT_PLAN_TLV_CYCLES           FAULT_PLAN_TLV(8u)
+#else
+#define FAULT_PLAN_TLV_CYCLES           0u
+#endif
+#ifdef FAULT_CAPTURE_MPU
+#define FAULT_PLAN_TLV_MPU              FAULT_PLAN_TLV(12u + 8u * FAULT_MPU_MAX_REGIONS)
+#define FAULT_PLAN_CYCLES_MPU           (FAULT_PLAN_CYCLES_PER_MPU * FAULT_MPU_MAX_REGIONS)
+#else
+#define FAULT_PLAN_TLV_MPU              0u
+#define FAULT_PLAN_CYCLES_MPU           0u
+#endif
+#ifdef FAULT_PERIPH_BUDGET
+#define FAULT_PLAN_TLV_PERIPH           FAULT_PLAN_TLV(FAULT_PERIPH_BUDGET)
+#define FAULT_PLAN_CYCLES_PERIPH        (FAULT_PLAN_CYCLES_PER_PERIPH * FAULT_PERIPH_BUDGET)
+#else
+#define FAULT_PLAN_TLV_PERIPH           0u
+#define FAULT_PLAN_CYCLES_PERIPH        0u
+#endif
+#ifdef FAULT_CAPTURE_REGIONS
+#define FAULT_PLAN_TLV_REGIONS          FAULT_PLAN_TLV(4u + 8u * FAULT_CAPTURE_REGIONS + FAULT_CAPTURE_REGION_BYTES)
+#define FAULT_PLAN_CYCLES_REGIONS       (FAULT_PLAN_CYCLES_PER_WORD * ((FAULT_CAPTURE_REGION_BYTES + 3u) / 4u))
+#else
+#define FAULT_PLAN_TLV_REGIONS          0u
+#define FAULT_PLAN_CYCLES_REGIONS       0u
+#endif
+#ifdef FAULT_CAPTURE_FP
+#define FAULT_PLAN_TLV_FP               FAULT_PLAN_TLV(80u)
+#define FAULT_PLAN_CYCLES_FPU           FAULT_PLAN_CYCLES_FP
+#else
+#define FAULT_PLAN_TLV_FP               0u
+#define FAULT_PLAN_CYCLES_FPU           0u
+#endif
+#ifdef FAULT_IMAGE_SLOTS
+#define FAULT_PLAN_TLV_IMAGES           FAULT_PLAN_TLV(4u + FAULT_IMAGE_SLOTS * sizeof(fault_image_t))
+#else
+#define FAULT_PLAN_TLV_IMAGES           0u
+#endif
+#ifdef FAULT_STACK_WINDOW_WORDS
+#define FAULT_PLAN_TLV_STACK            FAULT_PLAN_TLV(4u * FAULT_STACK_WINDOW_WORDS)
+#define FAULT_PLAN_CYCLES_STACK         (FAULT_PLAN_CYCLES_PER_WORD * FAULT_STACK_WINDOW_WORDS)
+#else
+#define FAULT_PLAN_TLV_STACK            0u
+#define FAULT_PLAN_CYCLES_STACK         0u
+#endif
+#ifdef FAULT_SNAPSHOT_SLOTS
+#define FAULT_PLAN_SNAPSHOT_BYTES       (FAULT_SNAPSHOT_SLOTS * sizeof(fault_record_t))
+#else
+#define FAULT_PLAN_SNAPSHOT_BYTES       0u
+#endif
+#ifdef FAULT_DIV0_RESULT
+#define FAULT_PLAN_DIV0_BYTES           sizeof(fault_div0_stats_t)
+#else
+#define FAULT_PLAN_DIV0_BYTES           0u
+#endif
+#ifdef FAULT_UNALIGNED_EMULATE
+#define FAULT_PLAN_UNALIGNED_BYTES      sizeof(fault_unaligned_stats_t)
+#else
+#define FAULT_PLAN_UNALIGNED_BYTES      0u
+#endif
+#ifdef FAULT_UBSAN
+#define FAULT_PLAN_UBSAN_BYTES          sizeof(fault_ubsan_stats_t)
+#else
+#define FAULT_PLAN_UBSAN_BYTES          0u
+#endif
+#ifdef FAULT_RESET_CAUSE
+#define FAULT_PLAN_RESET_BYTES          sizeof(uint32_t)
+#else
+#define FAULT_PLAN_RESET_BYTES          0u
+#endif
+
+/** Section types counted in FAULT_PLAN_TLV_BYTES. */
+#define FAULT_PLAN_TLV_SECTIONS         11u
+
+/** Worst-case TLV record, all optional sections present and full. */
+#define FAULT_PLAN_TLV_BYTES \
+    (sizeof(fault_tlv_header_t) + FAULT_PLAN_TLV(72u) + FAULT_PLAN_TLV(20u) + FAULT_PLAN_TLV(12u) \
+     + FAULT_PLAN_TLV_TASK + FAULT_PLAN_TLV_CYCLES + FAULT_PLAN_TLV_MPU + FAULT_PLAN_TLV_PERIPH \
+     + FAULT_PLAN_TLV_REGIONS + FAULT_PLAN_TLV_FP + FAULT_PLAN_TLV_IMAGES + FAULT_PLAN_TLV_STACK)
+
+/** Persisted record: TLV encoding with FAULT_RECORD_TLV, fault_record_t otherwise. */
+#ifdef FAULT_RECORD_TLV
+#define FAULT_PLAN_RECORD_BYTES         FAULT_PLAN_TLV_BYTES
+#else
+#define FAULT_PLAN_RECORD_BYTES         sizeof(fault_record_t)
+#endif
+
+/** Objects in FAULT_RECORD_SECTION, of fault_ubsan.c too if FAULT_UBSAN is defined. */
+#define FAULT_PLAN_SECTION_BYTES \
+    (sizeof(fault_record_t) + FAULT_PLAN_SNAPSHOT_BYTES + FAULT_PLAN_DIV0_BYTES + FAULT_PLAN_UNALIGNED_BYTES \
+     + FAULT_PLAN_UBSAN_BYTES + FAULT_PLAN_RESET_BYTES)
+
+/** Estimated worst-case capture cycles with CPU copies. */
+#define FAULT_PLAN_CAPTURE_CYCLES \
+    (FAULT_PLAN_CYCLES_BASE + FAULT_PLAN_CYCLES_STACK + FAULT_PLAN_CYCLES_REGIONS + FAULT_PLAN_CYCLES_PERIPH \
+     + FAULT_PLAN_CYCLES_MPU + FAULT_PLAN_CYCLES_FPU)
+
+/**
+ * @brief   Report a fault detected by software (assert, stack protector, abort, ...).
+ * Captures the caller's registers, fills fault_record with FAULT_CLASS_SOFTWARE,
+ * and handles it according to the FAULT_CLASS_SOFTWARE policy.
+ * @param   code: Fault code, one of FAULT_SOFT_* or an application code.
+ * @param   file_id: Identifier of the source file, application defined.
+ * @param   line: Source line.
+ * @return  void, only if the policy action lets execution continue.
+ */
+void
+fault_capture_soft(uint32_t code, uint32_t file_id, uint32_t line);
+
+/**
+ * @brief   Capture registers, fault status and stack window of the caller without
+ * stopping. The next slot of fault_snapshots is overwritten with FAULT_CLASS_SNAPSHOT
+ * record; interrupts are masked only while the slot is filled.
+ * Available when FAULT_SNAPSHOT_SLOTS is defined.
+ * @param   tag: Application value stored into the code field.
+ * @return  void
+ */
+void
+fault_snapshot_now(uint32_t tag);
+
+/**
+ * @brief   Register memory region to be copied into the record on faults, e.g. RTOS
+ * task list or driver state. Available when FAULT_CAPTURE_REGIONS is defined.
+ * Regions are copied in registration order while FAULT_CAPTURE_REGION_BYTES lasts.
+ * @param   base: Start of the region.
+ * @param   len: Length in bytes.
+ * @return  0 on success, -1 if FAULT_CAPTURE_REGIONS regions are already registered.
+ */
+int
+fault_capture_region(const void *base, uint32_t len);
+
+/**
+ * @brief   Register a firmware image, so addresses in the record can be matched to
+ * the right ELF file and load offset by the host tools. Call at boot for the
+ * bootloader, the running application slot and loaded overlays. Available when
+ * FAULT_IMAGE_SLOTS is defined.
+ * @param   *build_id: GNU build ID of the image, descriptor of its .note.gnu.build-id.
+ * @param   id_len: Length of the build ID, leading FAULT_IMAGE_ID_BYTES bytes are kept.
+ * @param   load_address: Address the image runs at.
+ * @param   size: Size of the image in bytes.
+ * @return  0 on success, -1 if FAULT_IMAGE_SLOTS images are already registered.
+ */
+int
+fault_register_image(const void *build_id, uint32_t id_len, uint32_t load_address, uint32_t size);
+
+#ifdef FAULT_MEASURE_CYCLES
+/**
+ * @brief   Print the report of fault_record (registers, status analysis, stack window) again
+ * and measure it, to compare output configurations on the target. Available when
+ * FAULT_MEASURE_CYCLES is defined.
+ * @return  DWT cycles until the report has been handed over to the output, pipelined
+ * UART output flushed.
+ */
+uint32_t
+fault_report_benchmark(void);
+#endif
+
+#ifdef FAULT_RESET_CAUSE
+/**
+ * @brief   Find out why the last reset happened. Call once at boot, before anything can fault:
+ * combines FAULT_RESET_CAUSE() with the handler state retained in FAULT_RECORD_SECTION,
+ * then marks the handler idle. Available when FAULT_RESET_CAUSE is defined.
+ * @param   *info: Filled with the cause and whether fault_record is valid.
+ * @return  void
+ */
+void
+fault_reset_attribute(fault_reset_info_t *info);
+#endif
+
+#ifdef FAULT_BACKUP_WORDS
+/**
+ * @brief   Read the crash summary stored in backup domain registers by the fault handler.
+ * @param   *summary: Filled with the summary if it is valid.
+ * @return  0 if a valid summary is present, -1 if the registers hold none or the checksum fails.
+ */
+int
+fault_backup_read(fault_backup_summary_t *summary);
+
+/**
+ * @brief   Invalidate the crash summary in backup domain registers, e.g. once it has been reported.
+ * @return  void
+ */
+void
+fault_backup_clear(void);
+#endif
+
+/**
+ * @brief   Take samples out of the profiler ring. Single reader, may run while
+ * FAULT_PROFILER_SYMBOL interrupt keeps adding samples.
+ * Available when FAULT_PROFILER_SAMPLES is defined.
+ * @param   *samples: Where to store the samples.
+ * @param   max: Size of samples array.
+ * @return  Number of samples stored.
+ */
+uint32_t
+fault_profiler_read(fault_profiler_sample_t *samples, uint32_t max);
+
+#ifdef FAULT_MPU_VIRT_FIRST
+/**
+ * @brief   Unload all logical regions from hardware regions FAULT_MPU_VIRT_FIRST -
+ * FAULT_MPU_VIRT_LAST. Call on context switch, so the next task faults its own
+ * regions in. Interrupts are masked while the regions are cleared, MPU_RNR is preserved.
+ * @return  void
+ */
+void
+fault_mpu_virt_flush(void);
+#endif
+
+#ifdef FAULT_LAZY_ZERO_REGION
+/**
+ * @brief   Protect the lazily zeroed section with MPU region FAULT_LAZY_ZERO_REGION instead
+ * of zeroing it at boot. Each of 8 subregions is zeroed on the first data access to it.
+ * On ARMv8-M the section is covered by FAULT_LAZY_ZERO_REGION and the next region, so any
+ * access faults, and the whole section is zeroed at once. Requires MPU enabled with PRIVDEFENA,
+ * or a region allowing access to the section for unprivileged code (lower number on ARMv7-M).
+ * The section has to be NOLOAD in the linker script.
+ * @param   base: Start of the section, aligned to its size.
+ * @param   size_log2: Log2 of the section size, 8 - 31.
+ * @return  0 on success, -1 if size_log2 is out of range.
+ */
+int
+fault_lazy_zero_init(void *base, uint32_t size_log2);
+#endif
+
+#ifdef FAULT_LAZY_FPU
+/**
+ * @brief   Set FPU access for the task being switched in. Call from the RTOS context
+ * switch with the flag set by FAULT_FPU_USER_MARK(); tasks that never used the FPU
+ * run with it disabled and stack no FP context.
+ * @param   fp_user: Non-zero to enable CP10 and CP11, zero to disable them.
+ * @return  void
+ */
+void
+fault_lazy_fpu_switch(uint32_t fp_user);
+#endif
+
+#ifdef FAULT_EMULATE_SLOTS
+/**
+ * @brief   Add an entry to the undefined instruction dispatch table. On UNDEFINSTR
+ * UsageFault the first entry with (instr & mask) == match handles the instruction;
+ * if it succeeds the stacked PC is advanced past it and execution resumes.
+ * @param   *entry: Entry, has to stay valid while registered.
+ * @return  0 on success, -1 if all FAULT_EMULATE_SLOTS slots are used.
+ */
+int
+fault_emulate_register(fault_emu_entry_t *entry);
+#endif
+
+/**
+ * @brief   Read a register of the interrupted code.
+ * @param   *ctx: Context passed to the handler.
+ * @param   reg: Register number 0 - 15, R15 reads as the instruction address + 4.
+ * @return  Register value.
+ */
+uint32_t
+fault_emu_reg(const fault_emu_ctx_t *ctx, uint32_t reg);
+
+/**
+ * @brief   Write a register of the interrupted code. Writes to SP and PC are ignored.
+ * @param   *ctx: Context passed to the handler.
+ * @param   reg: Register number 0 - 14.
+ * @param   value: New value.
+ * @return  void
+ */
+void
+fault_emu_set_reg(fault_emu_ctx_t *ctx, uint32_t reg, uint32_t value);
+
+#ifdef FAULT_RECORD_TLV
+/**
+ * @brief   Encode the record as fault_tlv_header_t followed by sections present in it,
+ * e.g. to persist or upload it. Binary output uses the same format when
+ * FAULT_RECORD_TLV is defined. Available when FAULT_RECORD_TLV is defined.
+ * @param   *record: Captured record.
+ * @param   *buf: Output buffer.
+ * @param   size: Size of the buffer.
+ * @return  Encoded size, 0 if it does not fit.
+ */
+uint32_t
+fault_record_encode(const fault_record_t *record, void *buf, uint32_t size);
+#endif
+
+/**
+ * @brief   Assert that costs a compare and a 16-bit UDF instruction.
+ * If COND is false, UDF #ID raises UsageFault (HardFault on ARMv6-M), the handler
+ * finds UDF at the stacked PC and records FAULT_SOFT_CHECK with ID as the line.
+ * @param   COND: condition expected to be true.
+ * @param   ID: compile time constant check ID, 0 - 255.
+ */
+#define FAULT_CHECK(COND, ID) \
+    do { \
+        if (__builtin_expect(!(COND), 0)) { \
+            __asm volatile("UDF %0" : : "i" (ID)); \
+            __builtin_unreachable(); \
+        } \
+    } while (0)
+
+/**
+ * @brief   Same as FAULT_CHECK(), but uses 32-bit UDF.W instruction.
+ * @param   COND: condition expected to be true.
+ * @param   ID: compile time constant check ID, 0 - 65535.
+ */
+#define FAULT_CHECK_WIDE(COND, ID) \
+    do { \
+        if (__builtin_expect(!(COND), 0)) { \
+            __asm volatile("UDF.W %0" : : "i" (ID)); \
+            __builtin_unreachable(); \
+        } \
+    } while (0)
+
+#endif /* FAULT_HANDLER_H */
@@ -0,0 +1,112 @@
+/**
+ * @file    fault_ubsan.c
+ * @brief   Minimal UBSan runtime for bare metal.
+ *          Implements __ubsan_handle_*_minimal handlers called by code built with
+ *          -fsanitize=undefined -fsanitize-minimal-runtime:
+ *          - "_abort" variants and checks that can not continue report a software
+ *            fault through fault_capture_soft().
+ *          - Other variants report the same way, or only count the failed check if
+ *            FAULT_UBSAN_RECOVER is defined.
+ *          This file itself shall be built without -fsanitize.
+ */
+
+#include "fault_config.h"
+#include "fault_handler.h"
+
+#include <stdint.h>
+
+/* fault_ubsan_stats is counted in FAULT_PLAN_SECTION_BYTES only with FAULT_UBSAN. */
+#ifndef FAULT_UBSAN
+#error "Define FAULT_UBSAN in fault_config.h when fault_ubsan.c is built."
+#endif
+
+#ifdef FAULT_RECORD_SECTION
+#define FAULT_RECORD_ATTR   __attribute__((section(FAULT_RECORD_SECTION)))
+#else
+#define FAULT_RECORD_ATTR
+#endif
+
+/* Address the handler returns to, i.e. the instrumented code. */
+#define CALLER_PC   ((uint32_t)(uintptr_t)__builtin_return_address(0))
+
+/* Handler that may continue, plus its "_abort" variant. */
+#define UBSAN_HANDLER(NAME, KIND) \
+    __attribute__((no_sanitize("undefined"))) void \
+    __ubsan_handle_##NAME##_minimal(void) \
+    { \
+        report_check(KIND, CALLER_PC, 0); \
+    } \
+    __attribute__((no_sanitize("undefined"), noreturn)) void \
+    __ubsan_handle_##NAME##_minimal_abort(void) \
+    { \
+        report_check(KIND, CALLER_PC, 1); \
+        while(1); \
+    }
+
+/* Handler for a check that never continues. */
+#define UBSAN_HANDLER_NORECOVER(NAME, KIND) \
+    __attribute__((no_sanitize("undefined"), noreturn)) void \
+    __ubsan_handle_##NAME##_minimal(void) \
+    { \
+        report_check(KIND, CALLER_PC, 1); \
+        while(1); \
+    }
+
+fault_ubsan_stats_t fault_ubsan_stats FAULT_RECORD_ATTR;
+
+/**
+ * @brief   Record a failed check.
+ * @param   kind: One of FAULT_UBSAN_*.
+ * @param   pc: Return address into the instrumented code.
+ * @param   fatal: Non-zero if the check can not continue.
+ * @return  void
+ */
+static void
+report_check(uint32_t kind, uint32_t pc, int fatal)
+{
+    uint32_t i;
+
+    /* Retained RAM holds garbage after power-on. */
+    if (fault_ubsan_stats.magic != FAULT_STATS_MAGIC) {
+        for (i = 0u; i < FAULT_UBSAN_KINDS; i++) {
+            fault_ubsan_stats.count[i]   = 0u;
+            fault_ubsan_stats.last_pc[i] = 0u;
+        }
+        fault_ubsan_stats.magic = FAULT_STATS_MAGIC;
+    }
+    fault_ubsan_stats.count[kind]++;
+    fault_ubsan_stats.last_pc[kind] = pc;
+
+#ifdef FAULT_UBSAN_RECOVER
+    if (!fatal) {
+        return;
+    }
+#else
+    (void)fatal;
+#endif
+    fault_capture_soft(FAULT_SOFT_UBSAN, kind, pc);
+}
+
+UBSAN_HANDLER(type_mismatch, FAULT_UBSAN_TYPE_MISMATCH)
+UBSAN_HANDLER(alignment_assumption, FAULT_UBSAN_ALIGNMENT_ASSUMPTION)
+UBSAN_HANDLER(add_overflow, FAULT_UBSAN_ADD_OVERFLOW)
+UBSAN_HANDLER(sub_overflow, FAULT_UBSAN_SUB_OVERFLOW)
+UBSAN_HANDLER(mul_overflow, FAULT_UBSAN_MUL_OVERFLOW)
+UBSAN_HANDLER(negate_overflow, FAULT_UBSAN_NEGATE_OVERFLOW)
+UBSAN_HANDLER(divrem_overflow, FAULT_UBSAN_DIVREM_OVERFLOW)
+UBSAN_HANDLER(shift_out_of_bounds, FAULT_UBSAN_SHIFT_OUT_OF_BOUNDS)
+UBSAN_HANDLER(out_of_bounds, FAULT_UBSAN_OUT_OF_BOUNDS)
+UBSAN_HANDLER_NORECOVER(builtin_unreachable, FAULT_UBSAN_BUILTIN_UNREACHABLE)
+UBSAN_HANDLER_NORECOVER(missing_return, FAULT_UBSAN_MISSING_RETURN)
+UBSAN_HANDLER(vla_bound_not_positive, FAULT_UBSAN_VLA_BOUND_NOT_POSITIVE)
+UBSAN_HANDLER(float_cast_overflow, FAULT_UBSAN_FLOAT_CAST_OVERFLOW)
+UBSAN_HANDLER(load_invalid_value, FAULT_UBSAN_LOAD_INVALID_VALUE)
+UBSAN_HANDLER(invalid_builtin, FAULT_UBSAN_INVALID_BUILTIN)
+UBSAN_HANDLER(function_type_mismatch, FAULT_UBSAN_FUNCTION_TYPE_MISMATCH)
+UBSAN_HANDLER(implicit_conversion, FAULT_UBSAN_IMPLICIT_CONVERSION)
+UBSAN_HANDLER(nonnull_arg, FAULT_UBSAN_NONNULL_ARG)
+UBSAN_HANDLER(nonnull_return, FAULT_UBSAN_NONNULL_RETURN)
+UBSAN_HANDLER(nullability_arg, FAULT_UBSAN_NULLABILITY_ARG)
+UBSAN_HANDLER(nullability_return, FAULT_UBSAN_NULLABILITY_RETURN)
+UBSAN_HANDLER(pointer_overflow, FAULT_UBSAN_POINTER_OVERFLOW)
+UBSAN_HANDLER(cfi_check_fail, FAULT_UBSAN_CFI_CHECK_FAIL)
@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+"""Annotate fault handler output with peripheral register names.
+
+Usage: fault_decode.py --svd DEVICE.svd [LOG]
+
+Reads the report printed by the fault handler (from LOG or stdin) and appends
+register names to BFAR, MMAR and captured peripheral addresses, e.g.
+    BFAR:    0x40013808    (USART1->BRR)
+The SVD file is indexed once and cached per device under
+$XDG_CACHE_HOME/arm-fault-handler (or ~/.cache/arm-fault-handler), so batch
+processing of many logs does not parse the SVD again. Lookups go through a
+hash of fixed size address pages and take constant time.
+"""
+
+import argparse
+import hashlib
+import json
+import os
+import re
+import sys
+
+# Register index page size: registers are at most 4 bytes and naturally
+# aligned, so each one falls into exactly one page.
+REG_PAGE_SHIFT = 8
+# Peripheral index page size, address blocks are split into pages of this size.
+BLOCK_PAGE_SHIFT = 10
+
+INDEX_VERSION = 1
+
+
+class SvdIndex:
+    """Address to register / peripheral name map built from an SVD file."""
+
+    def __init__(self, regs, blocks):
+        # page -> [(start, end, name)]
+        self.regs = regs
+        self.blocks = blocks
+
+    @classmethod
+    def build(cls, path):
+        sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+        from svd import Device
+
+        device = Device(path)
+        regs = {}
+        for pname, reg_list in device.peripherals.items():
+            for reg in reg_list:
+                entry = (reg.address, reg.address + max(reg.width, 1),
+                         "%s->%s" % (pname, reg.name))
+                regs.setdefault(reg.address >> REG_PAGE_SHIFT, []).append(entry)
+        blocks = {}
+        for pname, start, size in device.blocks:
+            end = start + max(size, 1)
+            for page in range(start >> BLOCK_PAGE_SHIFT, ((end - 1) >> BLOCK_PAGE_SHIFT) + 1):
+                blocks.setdefault(page, []).append((start, end, pname))
+        return cls(regs, blocks)
+
+    @classmethod
+    def load(cls, path, cache_dir):
+        with open(path, "rb") as f:
+            digest = hashlib.sha1(f.read()).hexdigest()[:16]
+        name = os.path.splitext(os.path.basename(path))[0]
+        cache = os.path.join(cache_dir, "%s-%s.json" % (name, digest))
+        try:
+            with open(cache) as f:
+                data = json.load(f)
+            if data.get("version") == INDEX_VERSION:
+                return cls({int(k): v for k, v in data["regs"].items()},
+                           {int(k): v for k, v in data["blocks"].items()})
+        except (OSError, ValueError, KeyError):
+            pass
+        index = cls.build(path)
+        os.makedirs(cache_dir, exist_ok=True)
+        tmp = cache + ".tmp"
+        with open(tmp, "w") as f:
+            json.dump({"version": INDEX_VERSION, "regs": index.regs,
+                       "blocks": index.blocks}, f)
+        os.replace(tmp, cache)
+        return index
+
+    def lookup(self, address):
+        """Name of the register at address, peripheral+offset, or None."""
+        for start, end, name in self.regs.get(address >> REG_PAGE_SHIFT, ()):
+            if start <= address < end:
+                return name if address == start else "%s+%d" % (name, address - start)
+        for start, end, name in self.blocks.get(address >> BLOCK_PAGE_SHIFT, ()):
+            if start <= address < end:
+                return "%s+0x%X" % (name, address - start)
+        return None
+
+
+def default_cache_dir():
+    base = os.environ.get("XDG_CACHE_HOME") or os.path.join(os.path.expanduser("~"), ".cache")
+    return os.path.join(base, "arm-fault-handler")
+
+
+ADDRESS_LINE = re.compile(r"^\s*(?:BFAR|MMAR):\s*(0x[0-9A-Fa-f]+)")
+PERIPH_LINE = re.compile(r"^\s*(0x[0-9A-Fa-f]+):\s*0x[0-9A-Fa-f]+\s*$")
+
+
+def annotate(lines, index):
+    for line in lines:
+        text = line.rstrip("\n")
+        match = ADDRESS_LINE.match(text) or PERIPH_LINE.match(text)
+        if match and index is not None:
+            name = index.lookup(int(match.group(1), 16))
+            if name:
+                text = "%s    (%s)" % (text, name)
+        yield text
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("log", nargs="?", help="handler output, stdin if omitted")
+    parser.add_argument("--svd", help="CMSIS-SVD file of the device")
+    parser.add_argument("--cache-dir", default=default_cache_dir(),
+                        help="where SVD indexes are cached")
+    args = parser.parse_args(argv)
+
+    index = SvdIndex.load(args.svd, args.cache_dir) if args.svd else None
+    source = open(args.log) if args.log else sys.stdin
+    with source:
+        for text in annotate(source, index):
+            print(text)
+
+
+if __name__ == "__main__":
+    main()
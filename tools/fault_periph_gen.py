@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+"""Generate the peripheral snapshot descriptor table from an SVD subset.
+
+Usage: fault_periph_gen.py DEVICE.svd SELECTION OUT.c OUT.names
+
+SELECTION lists one PERIPH.REG pattern per line ('*' wildcards allowed,
+'#' starts a comment), e.g.:
+    DMA1.ISR
+    DMA2.*
+    FMC.BCR*
+Consecutive registers of the same width and side effect flag are merged into
+one descriptor. OUT.names holds register names, line N is name ID N; the host
+decoder uses it, so names do not take flash.
+"""
+
+import sys
+
+from svd import Device
+
+
+def build(device, patterns):
+    seen = set()
+    regs = []
+    for pattern in patterns:
+        for pname, reg in device.select(pattern):
+            if reg.address not in seen:
+                seen.add(reg.address)
+                regs.append(("%s->%s" % (pname, reg.name), reg))
+    regs.sort(key=lambda item: item[1].address)
+
+    descs = []
+    names = []
+    for name, reg in regs:
+        last = descs[-1] if descs else None
+        if (last is not None and last["width"] == reg.width
+                and last["side_effects"] == reg.side_effects
+                and last["address"] + last["count"] * last["width"] == reg.address
+                and last["count"] < 255):
+            last["count"] += 1
+        else:
+            descs.append({"address": reg.address, "width": reg.width,
+                          "count": 1, "side_effects": reg.side_effects,
+                          "name_id": len(names)})
+        names.append(name)
+    return descs, names
+
+
+def main(argv):
+    if len(argv) != 5:
+        sys.exit(__doc__)
+    device = Device(argv[1])
+    with open(argv[2]) as f:
+        patterns = [l.split("#")[0].strip() for l in f]
+    descs, names = build(device, [p for p in patterns if p])
+
+    with open(argv[3], "w") as out:
+        out.write("/* Generated by fault_periph_gen.py from %s, do not edit. */\n\n" % argv[1])
+        out.write('#include "fault_handler.h"\n\n')
+        out.write("const fault_periph_desc_t fault_periph_table[] = {\n")
+        for d in descs:
+            flags = "FAULT_PERIPH_SIDE_EFFECTS" if d["side_effects"] else "0u"
+            out.write("    { 0x%08Xu, %5du, %du, %3du, %s }, /* %s */\n" % (
+                d["address"], d["name_id"], d["width"], d["count"], flags,
+                names[d["name_id"]]))
+        out.write("};\n\n")
+        out.write("const uint32_t fault_periph_table_size = %d;\n" % len(descs))
+    with open(argv[4], "w") as out:
+        out.write("\n".join(names) + "\n")
+
+
+if __name__ == "__main__":
+    main(sys.argv)
@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+"""Turn profiler samples into folded stacks or a pprof profile.
+
+Usage: fault_profile.py --elf FIRMWARE.elf [--pprof OUT.pb.gz] [SAMPLES]
+
+SAMPLES holds samples drained by fault_profiler_read(), either as text lines
+with PC and LR in hex ("0x08001234 0x08000f01", other lines are ignored) or,
+with --binary, as raw little endian fault_profiler_sample_t array.
+Folded stacks ("caller;function count", input of flamegraph.pl and
+speedscope) are written to stdout unless --pprof is given.
+"""
+
+import argparse
+import collections
+import gzip
+import re
+import struct
+import sys
+
+from symbolizer import Symbolizer
+
+SAMPLE_LINE = re.compile(r"^\s*(?:\S+\s+)?(0x[0-9A-Fa-f]+)\s+(0x[0-9A-Fa-f]+)\s*$")
+
+
+def read_samples(path, binary):
+    if binary:
+        with open(path, "rb") as f:
+            data = f.read()
+        return [struct.unpack_from("<II", data, off)
+                for off in range(0, len(data) - 7, 8)]
+    samples = []
+    with (open(path) if path else sys.stdin) as f:
+        for line in f:
+            match = SAMPLE_LINE.match(line)
+            if match:
+                samples.append((int(match.group(1), 16), int(match.group(2), 16)))
+    return samples
+
+
+def caller_address(lr):
+    # LR points after the call instruction, step back into it.
+    return (lr & ~1) - 2
+
+
+def fold(samples, symbolizer):
+    stacks = collections.Counter()
+    for pc, lr in samples:
+        func = symbolizer.function(pc) or "0x%08x" % pc
+        caller = symbolizer.function(caller_address(lr))
+        if caller and caller != func:
+            stacks["%s;%s" % (caller, func)] += 1
+        else:
+            stacks[func] += 1
+    return stacks
+
+
+def _varint(value):
+    out = bytearray()
+    while True:
+        byte = value & 0x7F
+        value >>= 7
+        if value:
+            out.append(byte | 0x80)
+        else:
+            out.append(byte)
+            return bytes(out)
+
+
+def _field(number, value):
+    if isinstance(value, (bytes, bytearray)):
+        return _varint(number << 3 | 2) + _varint(len(value)) + value
+    return _varint(number << 3) + _varint(value)
+
+
+def pprof(samples, symbolizer):
+    """Serialized, gzipped perftools.profiles.Profile with one sample per PC/LR pair."""
+    strings = {"": 0}
+
+    def string(text):
+        return strings.setdefault(text, len(strings))
+
+    functions = {}
+    locations = {}
+    lines = symbolizer.lines([pc for pc, _ in samples] +
+                             [caller_address(lr) for _, lr in samples])
+
+    def location(address):
+        if address not in locations:
+            name = symbolizer.function(address) or "0x%08x" % address
+            source = lines.get(address) or ""
+            filename, _, line = source.rpartition(":")
+            function_id = functions.setdefault((name, filename), len(functions) + 1)
+            line_no = int(line) if line.isdigit() else 0
+            locations[address] = (len(locations) + 1, function_id, line_no)
+        return locations[address][0]
+
+    counts = collections.Counter()
+    for pc, lr in samples:
+        stack = [location(pc & ~1)]
+        if symbolizer.function(caller_address(lr)):
+            stack.append(location(caller_address(lr)))
+        counts[tuple(stack)] += 1
+
+    profile = bytearray()
+    profile += _field(1, _field(1, string("samples")) + _field(2, string("count")))
+    for stack, count in counts.items():
+        ids = b"".join(_varint(i) for i in stack)
+        profile += _field(2, _field(1, ids) + _field(2, _varint(count)))
+    for address, (loc_id, function_id, line_no) in locations.items():
+        line = _field(1, function_id) + (_field(2, line_no) if line_no else b"")
+        profile += _field(4, _field(1, loc_id) + _field(3, address) + _field(4, line))
+    for (name, filename), function_id in functions.items():
+        profile += _field(5, _field(1, function_id) + _field(2, string(name)) +
+                          _field(3, string(name)) +
+                          (_field(4, string(filename)) if filename else b""))
+    for text in sorted(strings, key=strings.get):
+        profile += _field(6, text.encode())
+    return gzip.compress(bytes(profile))
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("samples", nargs="?", help="sample dump, stdin if omitted")
+    parser.add_argument("--elf", required=True, help="firmware ELF with symbols")
+    parser.add_argument("--binary", action="store_true", help="samples are raw binary")
+    parser.add_argument("--pprof", help="write pprof profile to this file")
+    args = parser.parse_args(argv)
+
+    symbolizer = Symbolizer(args.elf)
+    samples = read_samples(args.samples, args.binary)
+    if args.pprof:
+        with open(args.pprof, "wb") as f:
+            f.write(pprof(samples, symbolizer))
+    else:
+        for stack, count in sorted(fold(samples, symbolizer).items()):
+            print("%s %d" % (stack, count))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,188 @@
+#!/usr/bin/env python3
+"""Decode binary fault records in the TLV format (FAULT_RECORD_TLV).
+
+Usage: fault_record.py [--triage] [--elf FIRMWARE.elf]... RECORD...
+
+Each RECORD file holds one record as written by fault_record_encode() or by
+the binary sink: fault_tlv_header_t followed by sections. --triage prints one
+line per record from the fixed header only (class, PC, LR, CFSR, code),
+without walking the sections. Sections of unknown type are listed by type and
+length and skipped, so newer firmware stays readable.
+
+With --elf, PC, LR and stack words pointing into code are named. If the
+record holds an image table (FAULT_IMAGE_SLOTS), give the ELF of every
+image (bootloader, both application slots, overlays); each address is
+symbolized with the ELF whose build ID matches the image containing it, at
+that image's load offset.
+"""
+
+import argparse
+import struct
+import sys
+
+TLV_MAGIC = 0xFA0171C0
+# magic, version, header_size, total_size, fault_class, pc, lr, cfsr, code
+HEADER = struct.Struct("<IHHIIIIII")
+TAG = struct.Struct("<HH")
+IMAGES = 11
+
+CLASSES = {0: "none", 1: "hard", 2: "memmanage", 3: "bus", 4: "usage", 5: "software",
+           6: "snapshot", 7: "nested", 8: "hang"}
+
+REGS = ("R0", "R1", "R2", "R3", "R12", "LR", "PC", "PSR",
+        "R4", "R5", "R6", "R7", "R8", "R9", "R10", "R11", "SP", "EXC_RETURN")
+STATUS = ("HFSR", "CFSR", "MMAR", "BFAR", "AFSR")
+SOFT = ("Code", "File", "Line")
+FP = ("FP flags", "FPCCR", "FPCAR") + tuple("S%d" % i for i in range(16)) + ("FPSCR",)
+
+
+def words(value):
+    return struct.unpack_from("<%dI" % (len(value) // 4), value)
+
+
+def named(names):
+    def decode(value, symbolizer=None):
+        return ["%-11s 0x%08X" % (name + ":", word) for name, word in zip(names, words(value))]
+    return decode
+
+
+def decode_mpu(value, symbolizer=None):
+    control, ctrl, count = struct.unpack_from("<III", value)
+    lines = ["CONTROL:    0x%08X" % control, "MPU_CTRL:   0x%08X" % ctrl]
+    regs = words(value[12:12 + 8 * count])
+    for i in range(count):
+        lines.append("Region %-3d  0x%08X 0x%08X" % (i, regs[i], regs[count + i]))
+    return lines
+
+
+def decode_regions(value, symbolizer=None):
+    count, = struct.unpack_from("<I", value)
+    data = 4 + 8 * count
+    lines = []
+    for i in range(count):
+        address, length = struct.unpack_from("<II", value, 4 + 8 * i)
+        lines.append("0x%08X: %s" % (address, value[data:data + length].hex()))
+        data += length
+    return lines
+
+
+def decode_stack(value, symbolizer=None):
+    return [describe(word, symbolizer) for word in words(value)]
+
+
+def read_images(value):
+    """[(build_id, load_address, size)] of an image table section."""
+    count, = struct.unpack_from("<I", value)
+    entry = (len(value) - 4) // count if count else 0
+    images = []
+    for i in range(count):
+        off = 4 + i * entry
+        load_address, size = struct.unpack_from("<II", value, off + entry - 8)
+        images.append((value[off:off + entry - 8], load_address, size))
+    return images
+
+
+def decode_images(value, symbolizer=None):
+    return ["0x%08X size 0x%08X build ID %s" % (load_address, size, build_id.hex())
+            for build_id, load_address, size in read_images(value)]
+
+
+SECTIONS = {
+    1: ("Registers", named(REGS)),
+    2: ("Fault status", named(STATUS)),
+    3: ("Software fault", named(SOFT)),
+    4: ("Task", named(("Task",))),
+    5: ("Cycles", named(("Capture", "Output"))),
+    6: ("MPU", decode_mpu),
+    7: ("Peripherals", lambda value, symbolizer=None: [value.hex()]),
+    8: ("Regions", decode_regions),
+    9: ("FP state", named(FP)),
+    10: ("Stack", decode_stack),
+    11: ("Images", decode_images),
+}
+
+
+class RecordError(Exception):
+    pass
+
+
+def header(data):
+    if len(data) < HEADER.size:
+        raise RecordError("record too short")
+    fields = HEADER.unpack_from(data)
+    if fields[0] != TLV_MAGIC:
+        raise RecordError("bad magic 0x%08X" % fields[0])
+    return dict(zip(("magic", "version", "header_size", "total_size", "fault_class",
+                     "pc", "lr", "cfsr", "code"), fields))
+
+
+def sections(data):
+    """Yield (type, value) of all sections, known or not."""
+    head = header(data)
+    end = min(head["total_size"], len(data))
+    offset = head["header_size"]
+    while offset + TAG.size <= end:
+        kind, length = TAG.unpack_from(data, offset)
+        offset += TAG.size
+        if offset + length > end:
+            raise RecordError("section %d truncated" % kind)
+        yield kind, data[offset:offset + length]
+        offset += (length + 3) & ~3
+
+
+def describe(address, symbolizer):
+    name = symbolizer.function(address & ~1) if symbolizer else None
+    return "0x%08X%s" % (address, " (%s)" % name if name else "")
+
+
+def make_symbolizer(elfs, found):
+    """Symbolizer for the record: per image if it has an image table, else the single ELF."""
+    if not elfs:
+        return None
+    from symbolizer import ImageSymbolizer, Symbolizer
+    for kind, value in found:
+        if kind == IMAGES:
+            return ImageSymbolizer(elfs, read_images(value))
+    return Symbolizer(elfs[0])
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("records", nargs="+", help="binary record files")
+    parser.add_argument("--triage", action="store_true", help="print fixed header fields only")
+    parser.add_argument("--elf", action="append", default=[],
+                        help="firmware ELF to name functions, repeat for each image")
+    args = parser.parse_args(argv)
+
+    status = 0
+    for path in args.records:
+        with open(path, "rb") as f:
+            data = f.read()
+        try:
+            head = header(data)
+            # Triage stays on the fixed header unless the image table is needed for symbols.
+            found = list(sections(data)) if args.elf or not args.triage else []
+            symbolizer = make_symbolizer(args.elf, found)
+            summary = "%s: %s PC %s LR %s CFSR 0x%08X code 0x%X" % (
+                path, CLASSES.get(head["fault_class"], str(head["fault_class"])),
+                describe(head["pc"], symbolizer), describe(head["lr"], symbolizer),
+                head["cfsr"], head["code"])
+            print(summary)
+            if args.triage:
+                continue
+            for kind, value in found:
+                title, decode = SECTIONS.get(kind, (None, None))
+                if decode is None:
+                    print("Section %d: %d bytes, skipped" % (kind, len(value)))
+                    continue
+                print(title + ":")
+                for line in decode(value, symbolizer):
+                    print("  " + line)
+        except RecordError as e:
+            print("%s: %s" % (path, e), file=sys.stderr)
+            status = 1
+    return status
+
+
+if __name__ == "__main__":
+    sys.exit(main())
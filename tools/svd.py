@@ -0,0 +1,121 @@
+"""Minimal CMSIS-SVD reader shared by the fault handler host tools.
+
+Only what the tools need is parsed: peripherals (including derivedFrom),
+registers (including dim arrays and clusters), their size and whether a read
+has side effects.
+"""
+
+import re
+import xml.etree.ElementTree as ET
+from collections import namedtuple
+
+Register = namedtuple("Register", "name address width side_effects")
+
+
+def _int(text):
+    text = text.strip().lower()
+    if text.startswith("#"):
+        return int(text[1:].replace("x", "0"), 2)
+    if text.startswith("0b"):
+        return int(text[2:], 2)
+    return int(text, 0)
+
+
+def _child_int(node, tag, default):
+    child = node.find(tag)
+    return _int(child.text) if child is not None else default
+
+
+def _dim_names(node, name):
+    """Expand dim/dimIndex of a register or cluster into (name, offset) pairs."""
+    dim = node.find("dim")
+    if dim is None:
+        return [(name, 0)]
+    count = _int(dim.text)
+    step = _child_int(node, "dimIncrement", 0)
+    index = node.find("dimIndex")
+    if index is not None:
+        text = index.text.strip()
+        if "," in text:
+            labels = [s.strip() for s in text.split(",")]
+        else:
+            first, last = text.split("-")
+            labels = [str(i) for i in range(int(first), int(last) + 1)]
+    else:
+        labels = [str(i) for i in range(count)]
+    result = []
+    for i, label in enumerate(labels[:count]):
+        if "[%s]" in name:
+            result.append((name.replace("[%s]", "[%s]" % label), i * step))
+        else:
+            result.append((name.replace("%s", label), i * step))
+    return result
+
+
+def _read_side_effects(reg):
+    if reg.find("readAction") is not None:
+        return True
+    return any(f.find("readAction") is not None for f in reg.iter("field"))
+
+
+def _registers(node, base, prefix, size):
+    for child in node:
+        if child.tag == "register":
+            width = _child_int(child, "size", size)
+            offset = _child_int(child, "addressOffset", 0)
+            for name, step in _dim_names(child, child.findtext("name").strip()):
+                yield Register(prefix + name, base + offset + step, width // 8,
+                               _read_side_effects(child))
+        elif child.tag == "cluster":
+            offset = _child_int(child, "addressOffset", 0)
+            csize = _child_int(child, "size", size)
+            for name, step in _dim_names(child, child.findtext("name").strip()):
+                yield from _registers(child, base + offset + step,
+                                      prefix + name + ".", csize)
+
+
+class Device:
+    """Registers of all peripherals of one SVD file."""
+
+    def __init__(self, path):
+        root = ET.parse(path).getroot()
+        self.name = root.findtext("name", "device").strip()
+        size = _child_int(root, "size", 32)
+        nodes = {p.findtext("name").strip(): p
+                 for p in root.iter("peripheral")}
+        # peripheral name -> list of Register, offsets resolved to addresses
+        self.peripherals = {}
+        # (peripheral name, start address, size) of every address block
+        self.blocks = []
+        for pname, node in nodes.items():
+            regs_node = node.find("registers")
+            source = node
+            if regs_node is None and node.get("derivedFrom"):
+                source = nodes[node.get("derivedFrom")]
+                regs_node = source.find("registers")
+            base = _child_int(node, "baseAddress", 0)
+            psize = _child_int(source, "size", size)
+            for block in (node.findall("addressBlock") or source.findall("addressBlock")):
+                self.blocks.append((pname, base + _child_int(block, "offset", 0),
+                                    _child_int(block, "size", 0)))
+            regs = []
+            if regs_node is not None:
+                regs = list(_registers(regs_node, base, "", psize))
+            self.peripherals[pname] = sorted(regs, key=lambda r: r.address)
+
+    def select(self, pattern):
+        """Registers matching PERIPH.REG pattern, '*' matches any run of characters."""
+        periph, _, reg = pattern.partition(".")
+        reg = reg or "*"
+        pre = re.compile(fnmatch_re(periph))
+        rre = re.compile(fnmatch_re(reg))
+        for pname in sorted(self.peripherals):
+            if not pre.fullmatch(pname):
+                continue
+            for r in self.peripherals[pname]:
+                if rre.fullmatch(r.name):
+                    yield pname, r
+
+
+def fnmatch_re(pattern):
+    return ".*".join(re.escape(p) for p in pattern.split("*"))
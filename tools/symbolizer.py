@@ -0,0 +1,155 @@
+"""Address to function / source line lookup shared by the host tools.
+
+Function names come from the ELF symbol table, read directly, so no
+toolchain is needed. Source file and line are added when addr2line
+(arm-none-eabi-addr2line by default) is available. ImageSymbolizer picks
+the ELF and load offset per address from the image table of a record.
+"""
+
+import bisect
+import shutil
+import struct
+import subprocess
+
+STT_FUNC = 2
+SHT_NOTE = 7
+NT_GNU_BUILD_ID = 3
+PT_LOAD = 1
+PF_X = 1
+
+
+def _read_elf(path):
+    """(data, endian, section headers) of a 32-bit ELF."""
+    with open(path, "rb") as f:
+        data = f.read()
+    if data[:4] != b"\x7fELF" or data[4] != 1:
+        raise ValueError("%s: not a 32-bit ELF file" % path)
+    endian = "<" if data[5] == 1 else ">"
+    shoff, = struct.unpack_from(endian + "I", data, 0x20)
+    shentsize, shnum = struct.unpack_from(endian + "HH", data, 0x2E)
+    sections = [struct.unpack_from(endian + "IIIIIIIIII", data, shoff + i * shentsize)
+                for i in range(shnum)]
+    return data, endian, sections
+
+
+def read_build_id(path):
+    """GNU build ID of a 32-bit ELF, or None."""
+    data, endian, sections = _read_elf(path)
+    for sh in sections:
+        if sh[1] != SHT_NOTE:
+            continue
+        off, end = sh[4], sh[4] + sh[5]
+        while off + 12 <= end:
+            namesz, descsz, kind = struct.unpack_from(endian + "III", data, off)
+            desc = off + 12 + ((namesz + 3) & ~3)
+            if kind == NT_GNU_BUILD_ID and data[off + 12:off + 12 + namesz] == b"GNU\0":
+                return data[desc:desc + descsz]
+            off = desc + ((descsz + 3) & ~3)
+    return None
+
+
+def read_link_address(path):
+    """Lowest address of executable loadable segments, where the image is linked to run."""
+    data, endian, _ = _read_elf(path)
+    phoff, = struct.unpack_from(endian + "I", data, 0x1C)
+    phentsize, phnum = struct.unpack_from(endian + "HH", data, 0x2A)
+    addresses = []
+    for i in range(phnum):
+        p_type, _, p_vaddr, _, p_filesz, _, p_flags, _ = struct.unpack_from(
+            endian + "IIIIIIII", data, phoff + i * phentsize)
+        if p_type == PT_LOAD and p_flags & PF_X and p_filesz:
+            addresses.append(p_vaddr)
+    return min(addresses) if addresses else 0
+
+
+def read_functions(path):
+    """Sorted list of (start, size, name) of FUNC symbols of a 32-bit ELF."""
+    data, endian, sections = _read_elf(path)
+    functions = []
+    for sh in sections:
+        # sh_type 2 is SHT_SYMTAB, sh_link is its string table
+        if sh[1] != 2:
+            continue
+        strtab = sections[sh[6]]
+        for off in range(sh[4], sh[4] + sh[5], 16):
+            name, value, size, info, _, shndx = struct.unpack_from(endian + "IIIBBH", data, off)
+            # shndx 0 is an undefined symbol
+            if info & 0xF != STT_FUNC or shndx == 0:
+                continue
+            start = strtab[4] + name
+            end = data.index(b"\0", start)
+            functions.append((value & ~1, size, data[start:end].decode(errors="replace")))
+    functions.sort()
+    return functions
+
+
+class Symbolizer:
+    """Symbolizes addresses of one ELF image loaded at offset from its link address."""
+
+    def __init__(self, elf, offset=0, addr2line="arm-none-eabi-addr2line"):
+        self.elf = elf
+        self.offset = offset
+        self.functions = read_functions(elf)
+        self.starts = [f[0] for f in self.functions]
+        self.addr2line = shutil.which(addr2line) if addr2line else None
+        self.cache = {}
+
+    def function(self, address):
+        """Name of the function containing address, or None."""
+        address = (address & ~1) - self.offset
+        i = bisect.bisect_right(self.starts, address) - 1
+        if i < 0:
+            return None
+        start, size, name = self.functions[i]
+        if size and address >= start + size:
+            return None
+        return name
+
+    def lines(self, addresses):
+        """{address: "file:line"} for addresses, empty if addr2line is not available."""
+        todo = [a for a in set(addresses) if a not in self.cache]
+        if todo and self.addr2line:
+            out = subprocess.run([self.addr2line, "-e", self.elf] +
+                                 ["0x%x" % ((a & ~1) - self.offset) for a in todo],
+                                 capture_output=True, text=True, check=False).stdout
+            for address, line in zip(todo, out.splitlines()):
+                self.cache[address] = None if line.startswith("??") else line.strip()
+        return {a: self.cache.get(a) for a in addresses}
+
+
+class ImageSymbolizer:
+    """Symbolizes addresses of several images, e.g. bootloader, application slot and overlays.
+
+    images is the image table of a record, [(build_id, load_address, size)], with
+    build_id holding the leading bytes of the GNU build ID. Each image is matched
+    to one of the ELF files by build ID and symbolized at load_address minus the
+    ELF link address. Images without a matching ELF are ignored.
+    """
+
+    def __init__(self, elfs, images, addr2line="arm-none-eabi-addr2line"):
+        by_id = {}
+        for elf in elfs:
+            build_id = read_build_id(elf)
+            if build_id:
+                by_id[build_id] = elf
+        self.images = []
+        for build_id, load_address, size in images:
+            build_id = build_id.rstrip(b"\0")
+            for full_id, elf in by_id.items():
+                if build_id and full_id.startswith(build_id):
+                    offset = load_address - read_link_address(elf)
+                    self.images.append((load_address, load_address + size,
+                                        Symbolizer(elf, offset, addr2line)))
+                    break
+
+    def symbolizer(self, address):
+        """Symbolizer of the image containing address, or None."""
+        address &= ~1
+        for start, end, symbolizer in self.images:
+            if start <= address < end:
+                return symbolizer
+        return None
+
+    def function(self, address):
+        symbolizer = self.symbolizer(address)
+        return symbolizer.function(address) if symbolizer else None